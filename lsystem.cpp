@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <array>
 #include <cmath>
 #include <iostream>
 #include <fstream>
@@ -6,6 +7,28 @@
 #include <vector>
 #include <stack>
 #include <map>
+#include <list>
+#include <deque>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// gcc and clang build the avx kernels with a target attribute and pick them at runtime, so they
+// don't need -mavx
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RUNTIME_AVX 1
+#endif
+#if defined(__AVX__) || defined(RUNTIME_AVX)
+#include <immintrin.h>
+#endif
 
 #define SDL_MAIN_HANDLED
 #ifdef _WIN32
@@ -14,221 +37,4138 @@
 #include <SDL2/SDL.h>
 #endif
 
-#include <glad/glad.h>
+#include <glad/glad.h>
+
+using namespace std;
+
+#define WIDTH 1920
+#define HEIGHT 1080
+// #define WIDTH 3440
+// #define HEIGHT 1440
+
+#define ANGLE_DELTA M_PI / (6 * 2)
+#define FORWARD_DELTA 100
+#define ZOOM_FACTOR 1.1
+// buffer swaps per vertical refresh: 1 waits for vsync, 0 doesn't and -1 is adaptive vsync where
+// the driver has it (plain vsync otherwise), override with -DSWAP_INTERVAL=...
+#ifndef SWAP_INTERVAL
+#define SWAP_INTERVAL 1
+#endif
+// most redraws per second while input keeps coming in, 0 for no cap, override with -DFRAME_CAP=...
+#ifndef FRAME_CAP
+#define FRAME_CAP 120
+#endif
+// upper bound on the memory a single regeneration may use, override with -DMEMORY_BUDGET_MB=...
+#ifndef MEMORY_BUDGET_MB
+#define MEMORY_BUDGET_MB 4096
+#endif
+// budget for uploaded geometry kept around across fractal switches
+#define GEOMETRY_CACHE_GPU_MB 1024
+// smallest gpu buffer the buffer pool hands out, larger ones come in quarter steps between powers of two
+#define MIN_POOLED_BUFFER_BYTES (64 << 10)
+// turn angles that are a fraction of a full turn with at most this denominator use a heading table
+#define MAX_HEADING_PERIOD 720
+// what the turtle accumulates positions in: DoubleCoordinates, FloatCoordinates or
+// FixedCoordinates, override with -DTURTLE_COORDINATES=...
+#ifndef TURTLE_COORDINATES
+#define TURTLE_COORDINATES DoubleCoordinates
+#endif
+#define FIXED_POINT_FRACTION_BITS 24
+// exact integer coordinates packed in 16 or 32 bits for the turn angles that allow them (90, 60,
+// 45, 36, 30 degrees, ...) and TURTLE_COORDINATES for the rest, turn on with -DEXACT_COORDINATES=1
+#ifndef EXACT_COORDINATES
+#define EXACT_COORDINATES 0
+#endif
+// rewrite steps with less input than this stay on a single thread
+#define PARALLEL_REWRITE_MIN_BYTES (1 << 20)
+// same for turtle interpretation
+#define PARALLEL_TURTLE_MIN_BYTES (1 << 20)
+// branches shorter than this are walked by the task of their parent branch
+#define PARALLEL_BRANCH_MIN_BYTES (1 << 16)
+// vertices per bounding box for view culling, even so separate lines never straddle two boxes
+#define CULL_CHUNK_VERTICES 4096
+// iteration levels below the current one kept around for level of detail, and the on screen
+// segment length below which a lower level is drawn instead
+#define LOD_LEVELS 4
+#define LOD_SEGMENT_PIXELS 2
+// build the lines of deterministic levels from copies of the lines of the expansions of a cut
+// level instead of running the turtle over every symbol, turn off with -DCOMPOSE_LINES=0
+#ifndef COMPOSE_LINES
+#define COMPOSE_LINES 1
+#endif
+// vertices written between uploads of a level that is drawn while it is being generated
+#define PROGRESSIVE_CHUNK_VERTICES (1 << 20)
+
+// replacement for symbol applied only when it is found between left and right, an empty context
+// matches anything
+struct ContextRule {
+	string left;
+	char symbol;
+	string right;
+	string replacement;
+};
+
+struct Lsystem {
+    // grammar alphabet subset that does not have production rules
+    vector<string> constants;
+    // starting string
+    string axiom;
+    // replacement lookup map
+    map<string, string> rules;
+    // angle magnitude for "+" and "-"
+    double angle;
+	bool is_context_free;
+	// tried in order before rules, only read when is_context_free is false
+	vector<ContextRule> context_rules = {};
+	// symbols skipped over when looking for the context of a symbol
+	string context_ignore = "";
+	// weighted replacements, one is picked per occurrence in place of the entry in rules
+	map<string, vector<pair<double, string>>> stochastic_rules = {};
+	// picks are a pure function of (seed, iteration, position) so every rewriter agrees on them
+	uint64_t seed = 0;
+	// "A(x) : x > 1 -> F(x)[+(30)A(x/2)]" style rules, when present the axiom is a parametric
+	// module string as well and everything above except angle is ignored
+	vector<string> parametric_rules = {};
+};
+
+void print_string(string out, size_t start)
+{
+	for(int i = start; i < out.size(); ++i) {
+		cout << out[i];
+	}
+	cout << endl;
+}
+
+template<typename T>
+void print_vector(vector<T> out, size_t start, size_t end = 0)
+{
+	int i = 0;
+	for(i = start; i < max(out.size(), end) -1; ++i) {
+		cout << out[i] << ", ";
+	}
+	cout << out[i] << endl;
+}
+
+void start_window_renderer_and_gl(SDL_Window **window, SDL_Renderer **renderer, SDL_GLContext *gl_context, size_t width, size_t height)
+{
+	// create the window, renderer and gl context
+	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+		std::cerr << "SDL2 video subsystem couldn't be initialized. Error: " << SDL_GetError() << std::endl;
+		exit(1);
+	}
+
+	// window
+    SDL_WindowFlags window_flags = (SDL_WindowFlags)(SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI);
+	*window = SDL_CreateWindow(
+		"L-Systems Explorer",
+		SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+		WIDTH, HEIGHT, window_flags
+	);
+
+	// renderer
+	*renderer = SDL_CreateRenderer(*window, -1, SDL_RENDERER_ACCELERATED);
+	if (*renderer == nullptr) {
+		std::cerr << "SDL2 Renderer couldn't be created. Error: "
+				<< SDL_GetError()
+				<< std::endl;
+		exit(1);
+	}
+
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 6);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+	SDL_GL_SetAttribute(SDL_GL_RED_SIZE, 8);
+	SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 8);
+	SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 8);
+	SDL_GL_SetAttribute(SDL_GL_ALPHA_SIZE, 8);
+    SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
+	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+
+	// create GL context
+	*gl_context = SDL_GL_CreateContext(*window);
+	// Load GL extensions using glad
+	if (!gladLoadGLLoader((GLADloadproc) SDL_GL_GetProcAddress)) {
+		std::cerr << "Failed to initialize the OpenGL context." << std::endl;
+		exit(1);
+	}
+	if (SDL_GL_SetSwapInterval(SWAP_INTERVAL) != 0 && SWAP_INTERVAL < 0)
+		SDL_GL_SetSwapInterval(1);
+	// std::cout << "OpenGL version loaded: " << GLVersion.major << "." << GLVersion.minor << std::endl;
+}
+
+unsigned int compile_shader(unsigned int shader_type, const std::string& shader_source)
+{
+	unsigned int shader_id = glCreateShader(shader_type);
+
+	const char* c_source = shader_source.c_str();
+	glShaderSource(shader_id, 1, &c_source, nullptr);
+	glCompileShader(shader_id);
+
+	GLint result;
+	glGetShaderiv(shader_id, GL_COMPILE_STATUS, &result);
+
+	if (result == GL_FALSE) {
+		int length;
+		glGetShaderiv(shader_id, GL_INFO_LOG_LENGTH, &length);
+
+		GLchar* strInfoLog = new GLchar[length + 1];
+		glGetShaderInfoLog(shader_id, length, &length, strInfoLog);
+
+		fprintf(stderr, "Compilation error in shader: %s\n", strInfoLog);
+		delete[] strInfoLog;
+	}
+
+	return shader_id;
+}
+
+unsigned int load_shaders(const std::string& vertexShaderFile, const std::string& fragmentShaderFile)
+{
+	std::ifstream is_vs(vertexShaderFile);
+	const std::string f_vs((std::istreambuf_iterator<char>(is_vs)), std::istreambuf_iterator<char>());
+
+	std::ifstream is_fs(fragmentShaderFile);
+	const std::string f_fs((std::istreambuf_iterator<char>(is_fs)), std::istreambuf_iterator<char>());
+
+	unsigned int id = glCreateProgram();
+
+	unsigned int vs = compile_shader(GL_VERTEX_SHADER, f_vs);
+	unsigned int fs = compile_shader(GL_FRAGMENT_SHADER, f_fs);
+
+	glAttachShader(id, vs);
+	glAttachShader(id, fs);
+
+	glLinkProgram(id);
+	glValidateProgram(id);
+
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	return id;
+}
+
+string run_step_context_free(Lsystem system, string step)
+{
+    // run single grammar generation step
+    string out;
+    for (size_t i = 0; i < step.size(); i++) {
+        string current = string(1, step[i]);
+        if (find(system.constants.begin(), system.constants.end(), current) != system.constants.end())
+            out.append(current);
+        else
+            out.append(system.rules[current]);
+    }
+    return out;
+}
+
+// instructions of the postfix programs rule conditions and module arguments compile to
+enum Opcode : uint8_t {
+	OP_CONSTANT, OP_PARAMETER,
+	OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_POWER, OP_NEGATE,
+	OP_LESS, OP_GREATER, OP_LESS_EQUAL, OP_GREATER_EQUAL, OP_EQUAL, OP_NOT_EQUAL,
+	OP_AND, OP_OR, OP_NOT
+};
+
+struct Instruction {
+	Opcode op;
+	// parameter slot read by OP_PARAMETER
+	uint32_t slot;
+	// value pushed by OP_CONSTANT
+	double value;
+};
+
+// span of ParametricLsystem::code holding a single expression
+struct Expression {
+	uint32_t offset;
+	uint32_t length;
+};
+
+#define EXPRESSION_STACK_SIZE 32
+
+double evaluate(const Instruction *code, uint32_t length, const double *parameters)
+{
+	// run a compiled expression against the parameters of a module, booleans are 0 or 1
+	double stack[EXPRESSION_STACK_SIZE];
+	size_t top = 0;
+	for (const Instruction *instruction = code; instruction != code + length; instruction++) {
+		switch (instruction->op) {
+			case OP_CONSTANT: stack[top++] = instruction->value; break;
+			case OP_PARAMETER: stack[top++] = parameters[instruction->slot]; break;
+			case OP_NEGATE: stack[top - 1] = -stack[top - 1]; break;
+			case OP_NOT: stack[top - 1] = stack[top - 1] == 0; break;
+			default: {
+				double b = stack[--top];
+				double &a = stack[top - 1];
+				switch (instruction->op) {
+					case OP_ADD: a = a + b; break;
+					case OP_SUBTRACT: a = a - b; break;
+					case OP_MULTIPLY: a = a * b; break;
+					case OP_DIVIDE: a = a / b; break;
+					case OP_POWER: a = pow(a, b); break;
+					case OP_LESS: a = a < b; break;
+					case OP_GREATER: a = a > b; break;
+					case OP_LESS_EQUAL: a = a <= b; break;
+					case OP_GREATER_EQUAL: a = a >= b; break;
+					case OP_EQUAL: a = a == b; break;
+					case OP_NOT_EQUAL: a = a != b; break;
+					case OP_AND: a = a != 0 && b != 0; break;
+					case OP_OR: a = a != 0 || b != 0; break;
+					default: break;
+				}
+			}
+		}
+	}
+	return stack[0];
+}
+
+class ExpressionParser {
+	// recursive descent parser for rule conditions and module arguments, emitting postfix code
+	// and tracking the evaluation stack depth so it never outgrows EXPRESSION_STACK_SIZE
+	const string &text;
+	const vector<string> &parameters;
+	vector<Instruction> &code;
+	size_t depth = 0;
+
+	void emit(Opcode op, uint32_t slot = 0, double value = 0)
+	{
+		code.push_back({op, slot, value});
+		if (op == OP_CONSTANT || op == OP_PARAMETER)
+			depth++;
+		else if (op != OP_NEGATE && op != OP_NOT)
+			depth--;
+		if (depth > EXPRESSION_STACK_SIZE)
+			fail("expression too deep");
+	}
+
+	void skip_spaces()
+	{
+		while (position < text.size() && isspace((unsigned char)text[position]))
+			position++;
+	}
+
+	bool accept(const char *token)
+	{
+		skip_spaces();
+		size_t length = strlen(token);
+		if (text.compare(position, length, token) != 0)
+			return false;
+		position += length;
+		return true;
+	}
+
+	void parse_or()
+	{
+		parse_and();
+		while (accept("||"))
+			parse_and(), emit(OP_OR);
+	}
+
+	void parse_and()
+	{
+		parse_comparison();
+		while (accept("&&"))
+			parse_comparison(), emit(OP_AND);
+	}
+
+	void parse_comparison()
+	{
+		parse_sum();
+		for (;;) {
+			if (accept("<=")) parse_sum(), emit(OP_LESS_EQUAL);
+			else if (accept(">=")) parse_sum(), emit(OP_GREATER_EQUAL);
+			else if (accept("==")) parse_sum(), emit(OP_EQUAL);
+			else if (accept("!=")) parse_sum(), emit(OP_NOT_EQUAL);
+			else if (accept("<")) parse_sum(), emit(OP_LESS);
+			else if (accept(">")) parse_sum(), emit(OP_GREATER);
+			else break;
+		}
+	}
+
+	void parse_sum()
+	{
+		parse_product();
+		for (;;) {
+			if (accept("+")) parse_product(), emit(OP_ADD);
+			else if (accept("-")) parse_product(), emit(OP_SUBTRACT);
+			else break;
+		}
+	}
+
+	void parse_product()
+	{
+		parse_unary();
+		for (;;) {
+			if (accept("*")) parse_unary(), emit(OP_MULTIPLY);
+			else if (accept("/")) parse_unary(), emit(OP_DIVIDE);
+			else break;
+		}
+	}
+
+	void parse_unary()
+	{
+		if (accept("-"))
+			parse_unary(), emit(OP_NEGATE);
+		else if (accept("!"))
+			parse_unary(), emit(OP_NOT);
+		else
+			parse_power();
+	}
+
+	void parse_power()
+	{
+		parse_primary();
+		if (accept("^"))
+			parse_unary(), emit(OP_POWER);
+	}
+
+	void parse_primary()
+	{
+		skip_spaces();
+		if (accept("(")) {
+			parse_or();
+			if (!accept(")"))
+				fail("expected ')'");
+			return;
+		}
+		if (position < text.size() && (isdigit((unsigned char)text[position]) || text[position] == '.')) {
+			const char *start = text.c_str() + position;
+			char *end;
+			double value = strtod(start, &end);
+			position += end - start;
+			emit(OP_CONSTANT, 0, value);
+			return;
+		}
+		size_t start = position;
+		while (position < text.size() && (isalnum((unsigned char)text[position]) || text[position] == '_'))
+			position++;
+		string name = text.substr(start, position - start);
+		auto parameter = find(parameters.begin(), parameters.end(), name);
+		if (name.empty() || parameter == parameters.end())
+			fail("unknown parameter '" + name + "'");
+		emit(OP_PARAMETER, (uint32_t)(parameter - parameters.begin()));
+	}
+
+public:
+	size_t position;
+
+	ExpressionParser(const string &text, size_t position, const vector<string> &parameters, vector<Instruction> &code)
+		: text(text), parameters(parameters), code(code), position(position) {}
+
+	void fail(const string &message)
+	{
+		cerr << "Parametric rule parse error: " << message << " in \"" << text << "\" at " << position << endl;
+		exit(1);
+	}
+
+	Expression parse()
+	{
+		Expression expression;
+		expression.offset = (uint32_t)code.size();
+		parse_or();
+		expression.length = (uint32_t)code.size() - expression.offset;
+		return expression;
+	}
+};
+
+// string of parametric modules, one symbol byte per module and the parameters in a side array
+struct ModuleString {
+	string symbols;
+	// parameters of module i are parameters[first_parameter[i] .. first_parameter[i + 1])
+	vector<uint32_t> first_parameter = {0};
+	vector<double> parameters;
+
+	uint32_t num_parameters(size_t i) const { return first_parameter[i + 1] - first_parameter[i]; }
+};
+
+// module of a successor, with its arguments as a span of ParametricLsystem::arguments
+struct ParametricModule {
+	char symbol;
+	uint32_t first_argument;
+	uint32_t num_arguments;
+};
+
+struct ParametricRule {
+	char symbol;
+	uint32_t num_parameters;
+	bool has_condition;
+	Expression condition;
+	// span of ParametricLsystem::successors
+	uint32_t first_successor;
+	uint32_t num_successors;
+};
+
+struct ParametricLsystem {
+	// code of every condition and argument back to back
+	vector<Instruction> code;
+	vector<Expression> arguments;
+	vector<ParametricModule> successors;
+	// grouped by symbol, in the order they are declared
+	vector<ParametricRule> rules;
+	// span of rules for every symbol byte
+	uint32_t first_rule[256];
+	uint32_t num_rules[256];
+	ModuleString axiom;
+	// most modules, parameters and F modules a single module can be replaced with
+	uint32_t max_successors[256];
+	uint32_t max_successor_parameters[256];
+	uint32_t max_successor_forwards[256];
+};
+
+vector<ParametricModule> parse_modules(ExpressionParser &parser, const string &text, vector<Expression> &arguments)
+{
+	// symbols each optionally followed by a parenthesized list of argument expressions
+	vector<ParametricModule> modules;
+	for (;;) {
+		while (parser.position < text.size() && isspace((unsigned char)text[parser.position]))
+			parser.position++;
+		if (parser.position >= text.size())
+			return modules;
+		ParametricModule module = {text[parser.position++], (uint32_t)arguments.size(), 0};
+		if (parser.position < text.size() && text[parser.position] == '(') {
+			parser.position++;
+			do {
+				arguments.push_back(parser.parse());
+				while (parser.position < text.size() && isspace((unsigned char)text[parser.position]))
+					parser.position++;
+			} while (parser.position < text.size() && text[parser.position++] == ',');
+			if (text[parser.position - 1] != ')')
+				parser.fail("expected ')'");
+		}
+		module.num_arguments = (uint32_t)arguments.size() - module.first_argument;
+		modules.push_back(module);
+	}
+}
+
+ParametricLsystem compile_parametric_lsystem(const string &axiom, const vector<string> &rules)
+{
+	// parse "A(x, y) : condition -> successor" rules once, conditions and arguments become postfix
+	// code so rewriting never looks at the rule text again
+	ParametricLsystem system;
+	vector<ParametricRule> parsed;
+	for (const string &rule : rules) {
+		vector<string> parameters;
+		ExpressionParser parser(rule, 0, parameters, system.code);
+		size_t arrow = rule.find("->");
+		if (arrow == string::npos)
+			parser.fail("expected '->'");
+		size_t colon = rule.find(':');
+		size_t predecessor_end = colon < arrow ? colon : arrow;
+
+		string predecessor = rule.substr(0, predecessor_end);
+		predecessor.erase(remove_if(predecessor.begin(), predecessor.end(), [](char c) { return isspace((unsigned char)c); }), predecessor.end());
+		if (predecessor.empty())
+			parser.fail("expected a predecessor");
+		if (predecessor.size() > 1) {
+			if (predecessor[1] != '(' || predecessor.back() != ')')
+				parser.fail("expected a parameter list");
+			string names = predecessor.substr(2, predecessor.size() - 3);
+			for (size_t start = 0; start <= names.size();) {
+				size_t comma = min(names.find(',', start), names.size());
+				parameters.push_back(names.substr(start, comma - start));
+				start = comma + 1;
+			}
+		}
+
+		ParametricRule compiled = {predecessor[0], (uint32_t)parameters.size(), colon < arrow, {0, 0}, 0, 0};
+		if (compiled.has_condition) {
+			string condition = rule.substr(colon + 1, arrow - colon - 1);
+			ExpressionParser condition_parser(condition, 0, parameters, system.code);
+			compiled.condition = condition_parser.parse();
+			while (condition_parser.position < condition.size() && isspace((unsigned char)condition[condition_parser.position]))
+				condition_parser.position++;
+			if (condition_parser.position != condition.size())
+				condition_parser.fail("unexpected character");
+		}
+		parser.position = arrow + 2;
+		vector<ParametricModule> successors = parse_modules(parser, rule, system.arguments);
+		compiled.first_successor = (uint32_t)system.successors.size();
+		compiled.num_successors = (uint32_t)successors.size();
+		system.successors.insert(system.successors.end(), successors.begin(), successors.end());
+		parsed.push_back(compiled);
+	}
+
+	stable_sort(parsed.begin(), parsed.end(), [](const ParametricRule &a, const ParametricRule &b) {
+		return (unsigned char)a.symbol < (unsigned char)b.symbol;
+	});
+	system.rules = parsed;
+	for (size_t c = 0; c < 256; c++) {
+		system.first_rule[c] = 0;
+		system.num_rules[c] = 0;
+		system.max_successors[c] = 1;
+		system.max_successor_parameters[c] = 0;
+		system.max_successor_forwards[c] = c == 'F';
+	}
+	for (size_t i = 0; i < system.rules.size(); i++) {
+		const ParametricRule &rule = system.rules[i];
+		unsigned char c = rule.symbol;
+		if (system.num_rules[c]++ == 0) {
+			system.first_rule[c] = (uint32_t)i;
+			system.max_successors[c] = 0;
+			system.max_successor_forwards[c] = 0;
+		}
+		uint32_t parameters = 0;
+		uint32_t forwards = 0;
+		for (uint32_t k = 0; k < rule.num_successors; k++) {
+			parameters += system.successors[rule.first_successor + k].num_arguments;
+			forwards += system.successors[rule.first_successor + k].symbol == 'F';
+		}
+		// a module no rule applies to is copied, so that counts as a replacement as well
+		system.max_successors[c] = max(system.max_successors[c], max(rule.num_successors, 1u));
+		system.max_successor_parameters[c] = max(system.max_successor_parameters[c], max(parameters, rule.num_parameters));
+		system.max_successor_forwards[c] = max(system.max_successor_forwards[c], max(forwards, (uint32_t)(c == 'F')));
+	}
+
+	// the axiom is a successor without parameters, evaluated once
+	vector<string> no_parameters;
+	vector<Instruction> axiom_code;
+	vector<Expression> axiom_arguments;
+	ExpressionParser parser(axiom, 0, no_parameters, axiom_code);
+	for (const ParametricModule &module : parse_modules(parser, axiom, axiom_arguments)) {
+		system.axiom.symbols.push_back(module.symbol);
+		for (uint32_t k = 0; k < module.num_arguments; k++) {
+			const Expression &argument = axiom_arguments[module.first_argument + k];
+			system.axiom.parameters.push_back(evaluate(axiom_code.data() + argument.offset, argument.length, nullptr));
+		}
+		system.axiom.first_parameter.push_back((uint32_t)system.axiom.parameters.size());
+	}
+	return system;
+}
+
+void run_parametric_step(const ParametricLsystem &system, const ModuleString &step, ModuleString &out)
+{
+	// run single parametric generation step: the first rule of the module's symbol with a matching
+	// parameter count and a true condition replaces it, modules without one are copied
+	out.symbols.clear();
+	out.first_parameter.assign(1, 0);
+	out.parameters.clear();
+	const Instruction *code = system.code.data();
+	for (size_t i = 0; i < step.symbols.size(); i++) {
+		unsigned char symbol = step.symbols[i];
+		const double *parameters = step.parameters.data() + step.first_parameter[i];
+		uint32_t num_parameters = step.num_parameters(i);
+
+		const ParametricRule *applied = nullptr;
+		for (uint32_t r = system.first_rule[symbol]; r < system.first_rule[symbol] + system.num_rules[symbol]; r++) {
+			const ParametricRule &rule = system.rules[r];
+			if (rule.num_parameters == num_parameters
+				&& (!rule.has_condition || evaluate(code + rule.condition.offset, rule.condition.length, parameters) != 0)) {
+				applied = &rule;
+				break;
+			}
+		}
+
+		if (!applied) {
+			out.symbols.push_back(symbol);
+			out.parameters.insert(out.parameters.end(), parameters, parameters + num_parameters);
+			out.first_parameter.push_back((uint32_t)out.parameters.size());
+			continue;
+		}
+		for (uint32_t k = 0; k < applied->num_successors; k++) {
+			const ParametricModule &module = system.successors[applied->first_successor + k];
+			out.symbols.push_back(module.symbol);
+			for (uint32_t a = 0; a < module.num_arguments; a++) {
+				const Expression &argument = system.arguments[module.first_argument + a];
+				out.parameters.push_back(evaluate(code + argument.offset, argument.length, parameters));
+			}
+			out.first_parameter.push_back((uint32_t)out.parameters.size());
+		}
+	}
+}
+
+ModuleString generate_parametric_lsystem(const ParametricLsystem &system, size_t num_iterations, const function<bool()> &cancelled = nullptr)
+{
+	// cancelled is optional and checked before every step, the string is left partial once it returns true
+	ModuleString next_step = system.axiom;
+	ModuleString scratch;
+	for (size_t i = 0; i < num_iterations && !(cancelled && cancelled()); i++) {
+		run_parametric_step(system, next_step, scratch);
+		swap(next_step, scratch);
+	}
+	return next_step;
+}
+
+// replacement of a single symbol, stored as a span of the compiled replacement pool
+struct Production {
+	uint32_t offset;
+	uint32_t length;
+	// constants rewrite to themselves and have no production rule
+	bool is_constant;
+	// span of CompiledLsystem::context_rules tried before this production
+	uint32_t first_context_rule;
+	uint32_t num_context_rules;
+	// span of CompiledLsystem::alternatives one of which replaces this production
+	uint32_t first_alternative;
+	uint32_t num_alternatives;
+};
+
+uint64_t splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+uint64_t counter_random(uint64_t seed, uint64_t iteration, uint64_t position)
+{
+	// counter based random number: no state is carried from one draw to the next, so serial,
+	// parallel and streamed rewriting all draw the same number for the same symbol
+	return splitmix64(splitmix64(splitmix64(seed) ^ iteration) ^ position);
+}
+
+struct CompiledContextRule {
+	string left;
+	string right;
+	// replacement span in the pool
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct CompiledLsystem {
+	// interned alphabet, symbol id -> character
+	string alphabet;
+	// character -> symbol id, characters outside the alphabet map to alphabet.size()
+	uint8_t symbol_ids[256];
+	// dispatch table indexed by symbol id, with one trailing empty production shared by
+	// every character outside the alphabet (same as the default entry of the rules map)
+	vector<Production> productions;
+	// every replacement string back to back
+	string replacement_pool;
+	string axiom;
+	double angle;
+	bool is_context_free;
+	// grouped by symbol, in the order they are declared
+	vector<CompiledContextRule> context_rules;
+	bool context_ignored[256];
+	// stochastic replacements grouped by symbol, a draw below threshold picks the alternative
+	vector<Production> alternatives;
+	vector<uint64_t> alternative_thresholds;
+	bool is_stochastic;
+	uint64_t seed;
+	// set for parametric L-systems, which are rewritten as module strings instead
+	shared_ptr<const ParametricLsystem> parametric;
+	// identifies the grammar, equal for L-systems that derive the same strings
+	uint64_t hash;
+
+	const Production &production(char symbol) const
+	{
+		return productions[symbol_ids[(unsigned char)symbol]];
+	}
+
+	// replacement of the symbol at position of the string rewritten by step number iteration
+	const Production &replacement(char symbol, size_t iteration, uint64_t position) const
+	{
+		const Production &base = production(symbol);
+		if (base.num_alternatives == 0)
+			return base;
+		uint64_t draw = counter_random(seed, iteration, position);
+		uint32_t last = base.first_alternative + base.num_alternatives - 1;
+		for (uint32_t i = base.first_alternative; i < last; i++) {
+			if (draw < alternative_thresholds[i])
+				return alternatives[i];
+		}
+		return alternatives[last];
+	}
+
+	// every symbol always rewrites the same way, so (symbol, depth) determines its expansion
+	bool is_deterministic() const { return is_context_free && !is_stochastic; }
+};
+
+bool has_context_rule(const Lsystem &system, char symbol)
+{
+	if (system.is_context_free)
+		return false;
+	for (const ContextRule &rule : system.context_rules) {
+		if (rule.symbol == symbol)
+			return true;
+	}
+	return false;
+}
+
+CompiledLsystem compile_lsystem(const Lsystem &system)
+{
+	// intern every symbol that can show up in a derivation and flatten the rules into a single pool
+	CompiledLsystem compiled;
+	compiled.axiom = system.axiom;
+	compiled.angle = system.angle;
+	compiled.is_context_free = system.is_context_free;
+	compiled.is_stochastic = !system.stochastic_rules.empty();
+	compiled.seed = system.seed;
+	if (!system.parametric_rules.empty())
+		compiled.parametric = make_shared<ParametricLsystem>(compile_parametric_lsystem(system.axiom, system.parametric_rules));
+
+	bool seen[256] = {false};
+	auto intern = [&](const string &symbols) {
+		for (char c : symbols) {
+			if (!seen[(unsigned char)c]) {
+				seen[(unsigned char)c] = true;
+				compiled.alphabet.push_back(c);
+			}
+		}
+	};
+	intern(system.axiom);
+	for (const string &constant : system.constants)
+		intern(constant);
+	for (const auto &rule : system.rules) {
+		intern(rule.first);
+		intern(rule.second);
+	}
+	if (!system.is_context_free) {
+		for (const ContextRule &rule : system.context_rules)
+			intern(string(1, rule.symbol) + rule.replacement);
+	}
+	for (const auto &rule : system.stochastic_rules) {
+		intern(rule.first);
+		for (const auto &alternative : rule.second)
+			intern(alternative.second);
+	}
+
+	memset(compiled.symbol_ids, (uint8_t)compiled.alphabet.size(), sizeof(compiled.symbol_ids));
+	for (size_t id = 0; id < compiled.alphabet.size(); id++)
+		compiled.symbol_ids[(unsigned char)compiled.alphabet[id]] = (uint8_t)id;
+
+	compiled.productions.assign(compiled.alphabet.size() + 1, Production{0, 0, false, 0, 0, 0, 0});
+	for (size_t id = 0; id < compiled.alphabet.size(); id++) {
+		string symbol(1, compiled.alphabet[id]);
+		Production &production = compiled.productions[id];
+		production.offset = (uint32_t)compiled.replacement_pool.size();
+		if (find(system.constants.begin(), system.constants.end(), symbol) != system.constants.end()) {
+			production.is_constant = true;
+			compiled.replacement_pool.append(symbol);
+		} else {
+			auto rule = system.rules.find(symbol);
+			if (rule != system.rules.end())
+				compiled.replacement_pool.append(rule->second);
+			else if (has_context_rule(system, compiled.alphabet[id]))
+				// a symbol left alone by its context rules stays as it is
+				compiled.replacement_pool.append(symbol);
+		}
+		production.length = (uint32_t)compiled.replacement_pool.size() - production.offset;
+
+		production.first_context_rule = (uint32_t)compiled.context_rules.size();
+		for (size_t i = 0; i < system.context_rules.size() && !system.is_context_free; i++) {
+			const ContextRule &rule = system.context_rules[i];
+			if (rule.symbol != compiled.alphabet[id])
+				continue;
+			compiled.context_rules.push_back({rule.left, rule.right, (uint32_t)compiled.replacement_pool.size(), (uint32_t)rule.replacement.size()});
+			compiled.replacement_pool.append(rule.replacement);
+		}
+		production.num_context_rules = (uint32_t)compiled.context_rules.size() - production.first_context_rule;
+
+		production.first_alternative = (uint32_t)compiled.alternatives.size();
+		auto stochastic = system.stochastic_rules.find(symbol);
+		if (stochastic != system.stochastic_rules.end() && !stochastic->second.empty()) {
+			double total = 0;
+			for (const auto &alternative : stochastic->second)
+				total += alternative.first;
+			double cumulative = 0;
+			for (const auto &alternative : stochastic->second) {
+				cumulative += alternative.first;
+				uint32_t offset = (uint32_t)compiled.replacement_pool.size();
+				compiled.replacement_pool.append(alternative.second);
+				compiled.alternatives.push_back(Production{offset, (uint32_t)alternative.second.size(), false, 0, 0, 0, 0});
+				double threshold = cumulative / total * 18446744073709551616.0;
+				compiled.alternative_thresholds.push_back(threshold >= 18446744073709551615.0 ? UINT64_MAX : (uint64_t)threshold);
+			}
+			// the first alternative stands in wherever a single replacement is expected
+			production.offset = compiled.alternatives[production.first_alternative].offset;
+			production.length = compiled.alternatives[production.first_alternative].length;
+		}
+		production.num_alternatives = (uint32_t)compiled.alternatives.size() - production.first_alternative;
+	}
+
+	memset(compiled.context_ignored, 0, sizeof(compiled.context_ignored));
+	for (char c : system.context_ignore)
+		compiled.context_ignored[(unsigned char)c] = true;
+
+	// fnv-1a over the axiom and every symbol with its replacement
+	compiled.hash = 14695981039346656037ull;
+	auto hash_bytes = [&](const char *bytes, size_t length) {
+		for (size_t i = 0; i < length; i++)
+			compiled.hash = (compiled.hash ^ (unsigned char)bytes[i]) * 1099511628211ull;
+	};
+	hash_bytes(compiled.axiom.data(), compiled.axiom.size() + 1);
+	for (size_t id = 0; id < compiled.alphabet.size(); id++) {
+		const Production &production = compiled.productions[id];
+		hash_bytes(&compiled.alphabet[id], 1);
+		hash_bytes(production.is_constant ? "c" : "r", 1);
+		hash_bytes(compiled.replacement_pool.data() + production.offset, production.length);
+		hash_bytes("", 1);
+		for (uint32_t i = 0; i < production.num_context_rules; i++) {
+			const CompiledContextRule &rule = compiled.context_rules[production.first_context_rule + i];
+			hash_bytes(rule.left.data(), rule.left.size() + 1);
+			hash_bytes(rule.right.data(), rule.right.size() + 1);
+			hash_bytes(compiled.replacement_pool.data() + rule.offset, rule.length);
+			hash_bytes("", 1);
+		}
+		for (uint32_t i = 0; i < production.num_alternatives; i++) {
+			const Production &alternative = compiled.alternatives[production.first_alternative + i];
+			hash_bytes(compiled.replacement_pool.data() + alternative.offset, alternative.length);
+			hash_bytes((const char *)&compiled.alternative_thresholds[production.first_alternative + i], sizeof(uint64_t));
+		}
+	}
+	hash_bytes((const char *)&compiled.seed, sizeof(compiled.seed));
+	for (const string &rule : system.parametric_rules)
+		hash_bytes(rule.data(), rule.size() + 1);
+	hash_bytes(system.context_ignore.data(), system.context_ignore.size() + 1);
+	return compiled;
+}
+
+void run_step_compiled(const CompiledLsystem &system, const string &step, string &out, size_t iteration)
+{
+	// run single grammar generation step through the dispatch table, sizing the output up front
+	size_t length = 0;
+	for (size_t i = 0; i < step.size(); i++)
+		length += system.replacement(step[i], iteration, i).length;
+
+	out.resize(length);
+	char *dst = &out[0];
+	const char *pool = system.replacement_pool.data();
+	for (size_t i = 0; i < step.size(); i++) {
+		const Production &production = system.replacement(step[i], iteration, i);
+		memcpy(dst, pool + production.offset, production.length);
+		dst += production.length;
+	}
+}
+
+vector<uint32_t> match_brackets(const string &step)
+{
+	// index of the matching bracket for every '[' and ']', UINT32_MAX everywhere else and for
+	// brackets without a match
+	vector<uint32_t> match(step.size(), UINT32_MAX);
+	vector<uint32_t> open;
+	for (size_t i = 0; i < step.size(); i++) {
+		if (step[i] == '[') {
+			open.push_back((uint32_t)i);
+		} else if (step[i] == ']' && !open.empty()) {
+			match[i] = open.back();
+			match[open.back()] = (uint32_t)i;
+			open.pop_back();
+		}
+	}
+	return match;
+}
+
+bool matches_left_context(const CompiledLsystem &system, const string &step, const vector<uint32_t> &match, size_t i, const string &context)
+{
+	// walk towards the root: ignored symbols are skipped, a ']' jumps over the whole sibling branch
+	// using the match table and a '[' steps out to the parent branch
+	size_t j = i;
+	for (size_t k = context.size(); k > 0; k--) {
+		for (;;) {
+			if (j == 0)
+				return false;
+			char c = step[--j];
+			if (c == ']') {
+				if (match[j] == UINT32_MAX)
+					return false;
+				j = match[j];
+			} else if (c != '[' && !system.context_ignored[(unsigned char)c]) {
+				break;
+			}
+		}
+		if (step[j] != context[k - 1])
+			return false;
+	}
+	return true;
+}
+
+bool matches_right_context(const CompiledLsystem &system, const string &step, const vector<uint32_t> &match, size_t i, const string &context)
+{
+	// walk along the current branch: ignored symbols are skipped, a '[' jumps over the whole child
+	// branch using the match table and a ']' ends the branch
+	size_t j = i;
+	for (char expected : context) {
+		for (;;) {
+			if (++j >= step.size())
+				return false;
+			char c = step[j];
+			if (c == '[') {
+				if (match[j] == UINT32_MAX)
+					return false;
+				j = match[j];
+			} else if (c == ']') {
+				return false;
+			} else if (!system.context_ignored[(unsigned char)c]) {
+				break;
+			}
+		}
+		if (step[j] != expected)
+			return false;
+	}
+	return true;
+}
+
+void run_step_context_sensitive(const CompiledLsystem &system, const string &step, string &out, size_t iteration)
+{
+	// run single grammar generation step, symbols with context rules try them in order before
+	// falling back to their context free production
+	vector<uint32_t> match = match_brackets(step);
+	const char *pool = system.replacement_pool.data();
+	out.clear();
+	out.reserve(step.size() * 2);
+	for (size_t i = 0; i < step.size(); i++) {
+		const Production &production = system.production(step[i]);
+		const Production &fallback = system.replacement(step[i], iteration, i);
+		uint32_t offset = fallback.offset;
+		uint32_t length = fallback.length;
+		for (uint32_t r = 0; r < production.num_context_rules; r++) {
+			const CompiledContextRule &rule = system.context_rules[production.first_context_rule + r];
+			if (matches_left_context(system, step, match, i, rule.left) && matches_right_context(system, step, match, i, rule.right)) {
+				offset = rule.offset;
+				length = rule.length;
+				break;
+			}
+		}
+		out.append(pool + offset, length);
+	}
+}
+
+class ThreadPool {
+	// fixed set of worker threads that run one parallel_for batch at a time, the calling thread
+	// takes part in every batch; batches must not be submitted from inside a batch
+	vector<thread> workers;
+	mutex submit_lock;
+	mutex lock;
+	condition_variable wake;
+	condition_variable done;
+	const function<void(size_t)> *job = nullptr;
+	size_t job_count = 0;
+	atomic<size_t> next_index{0};
+	size_t active = 0;
+	uint64_t batch = 0;
+	bool stopping = false;
+
+	void run_batch()
+	{
+		for (size_t i; (i = next_index.fetch_add(1)) < job_count;)
+			(*job)(i);
+	}
+
+	void worker_loop()
+	{
+		uint64_t seen = 0;
+		for (;;) {
+			{
+				unique_lock<mutex> guard(lock);
+				wake.wait(guard, [&] { return stopping || batch != seen; });
+				if (stopping)
+					return;
+				seen = batch;
+			}
+			run_batch();
+			lock_guard<mutex> guard(lock);
+			if (--active == 0)
+				done.notify_one();
+		}
+	}
+
+public:
+	ThreadPool(size_t num_threads)
+	{
+		for (size_t i = 1; i < num_threads; i++)
+			workers.emplace_back(&ThreadPool::worker_loop, this);
+	}
+
+	~ThreadPool()
+	{
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (thread &worker : workers)
+			worker.join();
+	}
+
+	// number of threads running a batch, including the caller
+	size_t size() const { return workers.size() + 1; }
+
+	void parallel_for(size_t count, const function<void(size_t)> &fn)
+	{
+		// run fn(0) .. fn(count - 1) across the pool and wait for all of them
+		if (workers.empty() || count <= 1) {
+			for (size_t i = 0; i < count; i++)
+				fn(i);
+			return;
+		}
+		lock_guard<mutex> submit(submit_lock);
+		{
+			lock_guard<mutex> guard(lock);
+			job = &fn;
+			job_count = count;
+			next_index = 0;
+			active = workers.size();
+			batch++;
+		}
+		wake.notify_all();
+		run_batch();
+		unique_lock<mutex> guard(lock);
+		done.wait(guard, [&] { return active == 0; });
+		job = nullptr;
+	}
+};
+
+ThreadPool &thread_pool()
+{
+	static ThreadPool pool(max(1u, thread::hardware_concurrency()));
+	return pool;
+}
+
+template<typename Task>
+class WorkStealingScheduler {
+	// tasks that spawn more tasks, run on top of a ThreadPool batch: every worker pushes and pops
+	// its own deque at the back and steals from the front of the others once it runs dry
+	vector<deque<Task>> queues;
+	unique_ptr<mutex[]> locks;
+	atomic<size_t> pending{0};
+
+	bool take(size_t worker, Task &task)
+	{
+		for (size_t k = 0; k < queues.size(); k++) {
+			size_t victim = (worker + k) % queues.size();
+			lock_guard<mutex> guard(locks[victim]);
+			if (queues[victim].empty())
+				continue;
+			if (k == 0) {
+				task = move(queues[victim].back());
+				queues[victim].pop_back();
+			} else {
+				task = move(queues[victim].front());
+				queues[victim].pop_front();
+			}
+			return true;
+		}
+		return false;
+	}
+
+public:
+	WorkStealingScheduler(size_t num_workers) : queues(num_workers), locks(new mutex[num_workers]) {}
+
+	void spawn(size_t worker, Task task)
+	{
+		pending++;
+		lock_guard<mutex> guard(locks[worker]);
+		queues[worker].push_back(move(task));
+	}
+
+	void run(ThreadPool &pool, const function<void(size_t, Task &)> &execute)
+	{
+		// execute(worker, task) may spawn onto worker, returns once every task has run
+		pool.parallel_for(queues.size(), [&](size_t worker) {
+			Task task;
+			while (pending > 0) {
+				if (take(worker, task)) {
+					execute(worker, task);
+					pending--;
+				} else {
+					this_thread::yield();
+				}
+			}
+		});
+	}
+};
+
+void run_step_parallel(const CompiledLsystem &system, const string &step, string &out, size_t iteration, ThreadPool &pool)
+{
+	// run single grammar generation step split into chunks across the pool: every chunk sums the
+	// replacement lengths of its symbols, a prefix sum over those places each chunk in the output,
+	// then every chunk writes its own disjoint range of the pre-sized buffer
+	if (step.size() < PARALLEL_REWRITE_MIN_BYTES || pool.size() == 1) {
+		run_step_compiled(system, step, out, iteration);
+		return;
+	}
+	size_t num_chunks = pool.size() * 4;
+	size_t chunk_size = (step.size() + num_chunks - 1) / num_chunks;
+	vector<size_t> offsets(num_chunks + 1, 0);
+
+	pool.parallel_for(num_chunks, [&](size_t chunk) {
+		size_t end = min(step.size(), (chunk + 1) * chunk_size);
+		size_t length = 0;
+		for (size_t i = chunk * chunk_size; i < end; i++)
+			length += system.replacement(step[i], iteration, i).length;
+		offsets[chunk + 1] = length;
+	});
+	for (size_t chunk = 0; chunk < num_chunks; chunk++)
+		offsets[chunk + 1] += offsets[chunk];
+
+	out.resize(offsets[num_chunks]);
+	char *dst_base = &out[0];
+	const char *pool_base = system.replacement_pool.data();
+	pool.parallel_for(num_chunks, [&](size_t chunk) {
+		size_t end = min(step.size(), (chunk + 1) * chunk_size);
+		char *dst = dst_base + offsets[chunk];
+		for (size_t i = chunk * chunk_size; i < end; i++) {
+			const Production &production = system.replacement(step[i], iteration, i);
+			memcpy(dst, pool_base + production.offset, production.length);
+			dst += production.length;
+		}
+	});
+}
+
+void run_step(const CompiledLsystem &system, const string &step, string &out, size_t iteration)
+{
+	// rewrite step, the iteration number'th step of the derivation
+	if (system.is_context_free)
+		run_step_parallel(system, step, out, iteration, thread_pool());
+	else
+		run_step_context_sensitive(system, step, out, iteration);
+}
+
+string generate_lsystem(const CompiledLsystem &system, size_t num_iterations, const function<bool()> &cancelled = nullptr)
+{
+	// run the desired number of iterations, ping-ponging between two buffers; cancelled is
+	// optional and checked before every step, the string is left partial once it returns true
+	string next_step = system.axiom;
+	string scratch;
+	for (size_t i = 0; i < num_iterations && !(cancelled && cancelled()); i++) {
+		run_step(system, next_step, scratch, i);
+		next_step.swap(scratch);
+	}
+	return next_step;
+}
+
+// string generate_lsystem(string axiom, map<string, string> rules, vector<string> constants, size_t num_iterations) {
+string generate_lsystem(Lsystem system, size_t num_iterations)
+{
+    // helper for running the desired number of iterations of an L-system given the starting axiom
+	// reference path through run_step_context_free, kept for comparing against the compiled rewriter
+    string next_step = system.axiom;
+    for (size_t i = 0; i < num_iterations; i++) {
+		next_step = run_step_context_free(system, next_step);
+    }
+    return next_step;
+}
+
+// saturating arithmetic for symbol counts, anything that doesn't fit sticks at UINT64_MAX
+uint64_t saturating_add(uint64_t a, uint64_t b)
+{
+	return a > UINT64_MAX - b ? UINT64_MAX : a + b;
+}
+
+uint64_t saturating_mul(uint64_t a, uint64_t b)
+{
+	if (a == 0 || b == 0)
+		return 0;
+	return a > UINT64_MAX / b ? UINT64_MAX : a * b;
+}
+
+// square matrix of symbol counts, entry (i, j) counts symbol j in the replacement of symbol i
+struct GrowthMatrix {
+	size_t size;
+	vector<uint64_t> counts;
+
+	uint64_t &at(size_t i, size_t j) { return counts[i * size + j]; }
+	uint64_t at(size_t i, size_t j) const { return counts[i * size + j]; }
+};
+
+GrowthMatrix multiply(const GrowthMatrix &a, const GrowthMatrix &b)
+{
+	GrowthMatrix out = {a.size, vector<uint64_t>(a.size * a.size, 0)};
+	for (size_t i = 0; i < a.size; i++)
+		for (size_t k = 0; k < a.size; k++) {
+			if (a.at(i, k) == 0)
+				continue;
+			for (size_t j = 0; j < a.size; j++)
+				out.at(i, j) = saturating_add(out.at(i, j), saturating_mul(a.at(i, k), b.at(k, j)));
+		}
+	return out;
+}
+
+vector<uint64_t> multiply(const vector<uint64_t> &v, const GrowthMatrix &m)
+{
+	vector<uint64_t> out(m.size, 0);
+	for (size_t i = 0; i < m.size; i++) {
+		if (v[i] == 0)
+			continue;
+		for (size_t j = 0; j < m.size; j++)
+			out[j] = saturating_add(out[j], saturating_mul(v[i], m.at(i, j)));
+	}
+	return out;
+}
+
+GrowthMatrix growth_matrix(const CompiledLsystem &system)
+{
+	// one row per interned symbol, counting what a single rewrite turns it into; symbols with
+	// several possible replacements take the largest count of every symbol over all of them,
+	// which keeps every prediction an upper bound
+	size_t size = system.alphabet.size();
+	GrowthMatrix m = {size, vector<uint64_t>(size * size, 0)};
+	vector<uint64_t> row(size);
+	auto count_replacement = [&](size_t i, uint32_t offset, uint32_t length) {
+		fill(row.begin(), row.end(), 0);
+		for (uint32_t k = 0; k < length; k++)
+			row[system.symbol_ids[(unsigned char)system.replacement_pool[offset + k]]] += 1;
+		for (size_t j = 0; j < size; j++)
+			m.at(i, j) = max(m.at(i, j), row[j]);
+	};
+	for (size_t i = 0; i < size; i++) {
+		const Production &production = system.productions[i];
+		count_replacement(i, production.offset, production.length);
+		for (uint32_t r = 0; r < production.num_context_rules; r++) {
+			const CompiledContextRule &rule = system.context_rules[production.first_context_rule + r];
+			count_replacement(i, rule.offset, rule.length);
+		}
+		for (uint32_t a = 0; a < production.num_alternatives; a++) {
+			const Production &alternative = system.alternatives[production.first_alternative + a];
+			count_replacement(i, alternative.offset, alternative.length);
+		}
+	}
+	return m;
+}
+
+vector<uint64_t> symbol_counts(const CompiledLsystem &system, size_t num_iterations)
+{
+	// occurrences of every symbol after num_iterations steps: axiom counts times the growth matrix
+	// to the power num_iterations, by repeated squaring so any iteration costs O(log n) products
+	vector<uint64_t> counts(system.alphabet.size(), 0);
+	for (char c : system.axiom)
+		counts[system.symbol_ids[(unsigned char)c]] += 1;
+
+	GrowthMatrix power = growth_matrix(system);
+	for (size_t n = num_iterations; n > 0; n >>= 1) {
+		if (n & 1)
+			counts = multiply(counts, power);
+		if (n > 1)
+			power = multiply(power, power);
+	}
+	return counts;
+}
+
+// predicted size of a derivation and of the geometry drawn from it
+struct DerivationSize {
+	uint64_t length;
+	uint64_t forward_count;
+	uint64_t vertex_bytes;
+	// at least one count overflowed 64 bits, the sizes above are lower bounds
+	bool saturated;
+	// false when the grammar picks between replacements, the sizes above are upper bounds
+	bool exact;
+};
+
+DerivationSize derivation_size(const CompiledLsystem &system, const vector<uint64_t> &counts)
+{
+	DerivationSize size = {0, 0, 0, false, system.is_deterministic()};
+	for (size_t id = 0; id < counts.size(); id++) {
+		size.length = saturating_add(size.length, counts[id]);
+		if (system.alphabet[id] == 'F')
+			size.forward_count = counts[id];
+		size.saturated |= counts[id] == UINT64_MAX;
+	}
+	// every F becomes a line, two vertices of two floats
+	size.vertex_bytes = saturating_mul(size.forward_count, 4 * sizeof(float));
+	size.saturated |= size.length == UINT64_MAX || size.vertex_bytes == UINT64_MAX;
+	return size;
+}
+
+DerivationSize predict_derivation_size(const CompiledLsystem &system, size_t num_iterations)
+{
+	return derivation_size(system, symbol_counts(system, num_iterations));
+}
+
+uint64_t generation_footprint(const DerivationSize &size)
+{
+	// peak memory of a regeneration: the flattened derivation, and the vertex vector which can be
+	// up to twice its final size while it grows
+	return saturating_add(size.length, saturating_mul(size.vertex_bytes, 2));
+}
+
+uint64_t predict_generation_footprint(const CompiledLsystem &system, size_t num_iterations)
+{
+	return generation_footprint(predict_derivation_size(system, num_iterations));
+}
+
+uint64_t predict_streamed_footprint(const CompiledLsystem &system, size_t num_iterations)
+{
+	// peak memory of a streamed regeneration, only the growing vertex vector is alive
+	return saturating_mul(predict_derivation_size(system, num_iterations).vertex_bytes, 2);
+}
+
+size_t admissible_parametric_iterations(const ParametricLsystem &system, size_t num_iterations, uint64_t budget)
+{
+	// parameters decide which rules apply, so walk the actual levels and stop before the first one
+	// that could go over the budget given the largest replacement of every module of the level above
+	auto bytes = [](uint64_t modules, uint64_t parameters) {
+		return saturating_add(saturating_mul(modules, 1 + sizeof(uint32_t)), saturating_mul(parameters, sizeof(double)));
+	};
+	ModuleString step = system.axiom;
+	ModuleString next;
+	for (size_t level = 0; level < num_iterations; level++) {
+		uint64_t modules = 0;
+		uint64_t parameters = 0;
+		uint64_t forwards = 0;
+		for (size_t i = 0; i < step.symbols.size(); i++) {
+			unsigned char symbol = step.symbols[i];
+			modules += system.max_successors[symbol];
+			parameters += max(system.max_successor_parameters[symbol], step.num_parameters(i));
+			forwards += system.max_successor_forwards[symbol];
+		}
+		uint64_t footprint = saturating_add(bytes(step.symbols.size(), step.parameters.size()), bytes(modules, parameters));
+		footprint = saturating_add(footprint, saturating_mul(forwards, 2 * 4 * sizeof(float)));
+		if (footprint > budget)
+			return level;
+		run_parametric_step(system, step, next);
+		swap(step, next);
+	}
+	return num_iterations;
+}
+
+size_t admissible_iterations(const CompiledLsystem &system, size_t num_iterations, uint64_t budget)
+{
+	if (system.parametric)
+		return admissible_parametric_iterations(*system.parametric, num_iterations, budget);
+
+	// largest iteration count up to num_iterations that fits within the budget at least when streamed
+	if (system.is_context_free) {
+		while (num_iterations > 0 && predict_streamed_footprint(system, num_iterations) > budget)
+			num_iterations--;
+		return num_iterations;
+	}
+	// context sensitive derivations can't be streamed and the growth matrix only bounds them, which
+	// is far too loose after a few dozen steps; when the bound doesn't fit, walk the actual levels
+	// and stop before the first one whose bound from the level above goes over the budget
+	if (predict_generation_footprint(system, num_iterations) <= budget)
+		return num_iterations;
+	GrowthMatrix growth = growth_matrix(system);
+	string step = system.axiom;
+	string next;
+	for (size_t level = 0; level < num_iterations; level++) {
+		vector<uint64_t> counts(system.alphabet.size(), 0);
+		for (char c : step)
+			counts[system.symbol_ids[(unsigned char)c]] += 1;
+		if (generation_footprint(derivation_size(system, multiply(counts, growth))) > budget)
+			return level;
+		run_step(system, step, next, level);
+		step.swap(next);
+	}
+	return num_iterations;
+}
+
+class DerivationStream {
+	// pull based depth first expansion of a derivation, only the path of productions from the
+	// axiom down to the symbol being emitted is kept, so memory is O(iterations * rule length)
+	struct Frame {
+		// remaining part of the rule being expanded
+		const char *position;
+		const char *end;
+		// rewrites still to be applied to the symbols of this rule
+		size_t depth;
+	};
+
+	const CompiledLsystem &system;
+	size_t num_iterations;
+	vector<Frame> frames;
+	// symbols of every level consumed so far, depth first order visits every level in order so
+	// this is the position stochastic picks are keyed on
+	vector<uint64_t> positions;
+
+public:
+	DerivationStream(const CompiledLsystem &system, size_t num_iterations)
+		: system(system), num_iterations(num_iterations), positions(system.is_stochastic ? num_iterations : 0, 0)
+	{
+		frames.reserve(num_iterations + 1);
+		const char *axiom = system.axiom.data();
+		frames.push_back({axiom, axiom + system.axiom.size(), num_iterations});
+	}
+
+	size_t next_block(char *out, size_t capacity)
+	{
+		// emit up to capacity symbols of the derivation, returns 0 once it is exhausted
+		size_t count = 0;
+		while (count < capacity && !frames.empty()) {
+			Frame &frame = frames.back();
+			if (frame.position == frame.end) {
+				frames.pop_back();
+				continue;
+			}
+			char symbol = *frame.position++;
+			const Production *production = &system.production(symbol);
+			if (!positions.empty() && frame.depth > 0) {
+				size_t level = num_iterations - frame.depth;
+				if (production->is_constant) {
+					// a constant sits at one position of every level below this one
+					for (; level < num_iterations; level++)
+						positions[level]++;
+				} else {
+					production = &system.replacement(symbol, level, positions[level]++);
+				}
+			}
+			if (frame.depth == 0 || production->is_constant) {
+				out[count++] = symbol;
+			} else if (production->length > 0) {
+				const char *rule = system.replacement_pool.data() + production->offset;
+				frames.push_back({rule, rule + production->length, frame.depth - 1});
+			}
+		}
+		return count;
+	}
+};
+
+class DerivationDag {
+	// derivation as a straight line program: node (symbol, depth) is the expansion of the symbol
+	// after depth rewrites and its children are the symbols of its production at depth - 1, so the
+	// n-th derivation is fully described by |alphabet| * (n + 1) nodes, none of them expanded
+	const CompiledLsystem &system;
+	size_t num_iterations;
+	// length of every node, indexed by depth * (alphabet size + 1) + symbol id
+	vector<uint64_t> lengths;
+
+	size_t node(char symbol, size_t depth) const
+	{
+		return depth * (system.alphabet.size() + 1) + system.symbol_ids[(unsigned char)symbol];
+	}
+
+public:
+	DerivationDag(const CompiledLsystem &system, size_t num_iterations)
+		: system(system), num_iterations(num_iterations),
+		  lengths((num_iterations + 1) * (system.alphabet.size() + 1), 0)
+	{
+		size_t width = system.alphabet.size() + 1;
+		for (size_t id = 0; id < system.alphabet.size(); id++)
+			lengths[id] = 1;
+		for (size_t depth = 1; depth <= num_iterations; depth++) {
+			for (size_t id = 0; id < system.alphabet.size(); id++) {
+				const Production &production = system.productions[id];
+				if (production.is_constant) {
+					lengths[depth * width + id] = 1;
+					continue;
+				}
+				uint64_t length = 0;
+				for (uint32_t k = 0; k < production.length; k++)
+					length = saturating_add(length, lengths[node(system.replacement_pool[production.offset + k], depth - 1)]);
+				lengths[depth * width + id] = length;
+			}
+		}
+	}
+
+	// length of the expansion of symbol after depth rewrites, saturates at UINT64_MAX
+	uint64_t length(char symbol, size_t depth) const { return lengths[node(symbol, depth)]; }
+
+	uint64_t length() const
+	{
+		uint64_t total = 0;
+		for (char c : system.axiom)
+			total = saturating_add(total, length(c, num_iterations));
+		return total;
+	}
+
+	char at(uint64_t index) const
+	{
+		// random access into the derivation by descending through the nodes covering index
+		const char *position = system.axiom.data();
+		size_t depth = num_iterations;
+		for (;;) {
+			uint64_t node_length;
+			while (index >= (node_length = length(*position, depth))) {
+				index -= node_length;
+				position++;
+			}
+			const Production &production = system.production(*position);
+			if (depth == 0 || production.is_constant)
+				return *position;
+			position = system.replacement_pool.data() + production.offset;
+			depth--;
+		}
+	}
+
+	string flatten() const
+	{
+		// expand the derivation into a string for the existing code paths, every node is expanded
+		// once and later occurrences are copied from its first occurrence in the output
+		string out(length(), '\0');
+		vector<uint64_t> first_offset(lengths.size(), UINT64_MAX);
+		struct Frame {
+			const char *position;
+			const char *end;
+			size_t depth;
+		};
+		vector<Frame> frames = {{system.axiom.data(), system.axiom.data() + system.axiom.size(), num_iterations}};
+		char *dst = &out[0];
+		uint64_t offset = 0;
+		while (!frames.empty()) {
+			Frame &frame = frames.back();
+			if (frame.position == frame.end) {
+				frames.pop_back();
+				continue;
+			}
+			char symbol = *frame.position++;
+			const Production &production = system.production(symbol);
+			if (frame.depth == 0 || production.is_constant) {
+				dst[offset++] = symbol;
+				continue;
+			}
+			size_t child = node(symbol, frame.depth);
+			if (first_offset[child] != UINT64_MAX) {
+				memcpy(dst + offset, dst + first_offset[child], lengths[child]);
+				offset += lengths[child];
+				continue;
+			}
+			first_offset[child] = offset;
+			const char *rule = system.replacement_pool.data() + production.offset;
+			frames.push_back({rule, rule + production.length, frame.depth - 1});
+		}
+		return out;
+	}
+
+	class const_iterator {
+		// walks the derivation in order, pulling blocks from a DerivationStream
+		shared_ptr<DerivationStream> stream;
+		shared_ptr<vector<char>> block;
+		size_t block_index = 0;
+		size_t block_size = 0;
+		uint64_t index;
+
+		void fill()
+		{
+			if (block_index == block_size && stream) {
+				block_size = stream->next_block(block->data(), block->size());
+				block_index = 0;
+			}
+		}
+
+	public:
+		const_iterator(const CompiledLsystem &system, size_t num_iterations)
+			: stream(make_shared<DerivationStream>(system, num_iterations)),
+			  block(make_shared<vector<char>>(4096)), index(0) { fill(); }
+		explicit const_iterator(uint64_t index) : index(index) {}
+
+		char operator*() const { return (*block)[block_index]; }
+		const_iterator &operator++() { block_index++; index++; fill(); return *this; }
+		bool operator==(const const_iterator &other) const { return index == other.index; }
+		bool operator!=(const const_iterator &other) const { return index != other.index; }
+	};
+
+	const_iterator begin() const { return const_iterator(system, num_iterations); }
+	const_iterator end() const { return const_iterator(length()); }
+};
+
+// axis aligned box in plane coordinates: min x, min y, max x, max y
+typedef array<float, 4> Box;
+
+const Box empty_box = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+
+void extend_box(Box &box, float x, float y)
+{
+	box[0] = min(box[0], x);
+	box[1] = min(box[1], y);
+	box[2] = max(box[2], x);
+	box[3] = max(box[3], y);
+}
+
+void extend_box(Box &box, const Box &other)
+{
+	box[0] = min(box[0], other[0]);
+	box[1] = min(box[1], other[1]);
+	box[2] = max(box[2], other[2]);
+	box[3] = max(box[3], other[3]);
+}
+
+struct ChunkBounds {
+	// bounding box of every run of CULL_CHUNK_VERTICES vertices of a vertex buffer, shared by all
+	// turtles writing into it; a box also covers the first vertex of the next run so that line
+	// strips going from one run into the next stay inside the boxes of the runs they are drawn with
+	vector<Box> boxes;
+	mutex lock;
+	// position of the last vertex, where the turtle ends up on curves without branches
+	size_t num_vertices;
+	float last_x = 0;
+	float last_y = 0;
+
+	ChunkBounds(size_t num_vertices)
+		: boxes(num_vertices / CULL_CHUNK_VERTICES + 1, empty_box), num_vertices(num_vertices) {}
+
+	void merge(size_t chunk, const Box &box)
+	{
+		lock_guard<mutex> guard(lock);
+		extend_box(boxes[chunk], box);
+	}
+};
+
+struct BoundsTracker {
+	// per turtle side of ChunkBounds: grows the box of the run being written locally and merges
+	// it into the shared one whenever the turtle moves on to another run, so the lock is taken
+	// once per run and not once per vertex
+	ChunkBounds *bounds = nullptr;
+	const char *base = nullptr;
+	size_t vertex_size = 0;
+	const char *chunk_begin = nullptr;
+	const char *chunk_end = nullptr;
+	const char *last_vertex = nullptr;
+	size_t chunk = 0;
+	Box box = empty_box;
+
+	void start(ChunkBounds *chunk_bounds, const void *buffer, size_t size)
+	{
+		bounds = chunk_bounds;
+		base = (const char *)buffer;
+		vertex_size = size;
+		if (bounds && bounds->num_vertices > 0)
+			last_vertex = base + (bounds->num_vertices - 1) * vertex_size;
+	}
+
+	void add(const void *at, float x, float y)
+	{
+		// vertex at the given place in the buffer
+		if (!bounds)
+			return;
+		const char *vertex = (const char *)at;
+		if (vertex < chunk_begin || vertex >= chunk_end) {
+			flush();
+			chunk = (vertex - base) / vertex_size / CULL_CHUNK_VERTICES;
+			chunk_begin = base + chunk * CULL_CHUNK_VERTICES * vertex_size;
+			chunk_end = chunk_begin + CULL_CHUNK_VERTICES * vertex_size;
+		}
+		extend_box(box, x, y);
+		if (vertex == chunk_begin && chunk > 0)
+			bounds->merge(chunk - 1, {x, y, x, y});
+		if (vertex == last_vertex) {
+			bounds->last_x = x;
+			bounds->last_y = y;
+		}
+	}
+
+	void flush()
+	{
+		if (bounds && box[0] <= box[2])
+			bounds->merge(chunk, box);
+		box = empty_box;
+	}
+
+	~BoundsTracker() { flush(); }
+};
+
+struct Turtle {
+	// turtle graphics state, fed one instruction at a time
+	// writes lines through out serialized in order x1, y1, x2, y2, out must have room for four
+	// floats per F still to come; with strips set it writes line strips instead, see StripRanges
+	double angle_delta;
+	double forward_distance;
+	float *out;
+	bool strips = false;
+	bool strip_open = false;
+	BoundsTracker bounds;
+
+	double x = 0;
+	double y = 0;
+	double angle = 0;
+	stack<tuple<double, double, double>> saved_position;
+
+	Turtle(double angle_delta, double forward_distance, float *out)
+		: angle_delta(angle_delta), forward_distance(forward_distance), out(out) {}
+
+	void run(char instruction)
+	{
+        switch(instruction) {
+            // move forward
+            case 'F': {
+                // extend (x, y) with (0, forward_distance) and rotate to by the angle
+                double new_x = x + forward_distance*sin(angle);
+                double new_y = y - forward_distance*cos(angle);
+
+                if (!strips || !strip_open) {
+                    bounds.add(out, +x, -y);
+                    out[0] = +x;
+                    out[1] = -y;
+                    out += 2;
+                    strip_open = strips;
+                }
+                bounds.add(out, +new_x, -new_y);
+                out[0] = +new_x;
+                out[1] = -new_y;
+                out += 2;
+
+                y = new_y;
+                x = new_x;
+                break;
+            }
+            // update angle
+            case '-':
+                angle = fmod(angle - angle_delta, 2*M_PI);
+                break;
+            case '+':
+                angle = fmod(angle + angle_delta, 2*M_PI);
+                break;
+            // push/pop position and angle stack
+            case '[':
+                saved_position.push(tuple<double, double, double>(x, y, angle));
+                break;
+            case ']':
+				double pop_x, pop_y, pop_angle;
+				tie(pop_x, pop_y, pop_angle) = saved_position.top();
+				x = pop_x;
+				y = pop_y;
+				angle = pop_angle;
+				saved_position.pop();
+				strip_open = false;
+                break;
+            default: break;
+        }
+	}
+};
+
+int64_t heading_period(double angle_delta)
+{
+	// smallest number of turns by angle_delta that add up to whole turns, 0 when there is none up
+	// to MAX_HEADING_PERIOD and the angle is treated as irrational
+	double turns = angle_delta / (2 * M_PI);
+	for (int64_t period = 1; period <= MAX_HEADING_PERIOD; period++) {
+		double whole = turns * period;
+		if (fabs(whole - round(whole)) < 1e-9)
+			return period;
+	}
+	return 0;
+}
+
+class HeadingTable {
+	// forward step for every heading the turtle can reach, a heading being the number of turns by
+	// angle_delta taken from the start; for rational angles headings wrap around at the period and
+	// the table is built up front, otherwise the steps are computed the first time a heading is used
+	double angle_delta;
+	double forward_distance;
+	int64_t first_heading = 0;
+	vector<double> step_x;
+	vector<double> step_y;
+
+	void extend(int64_t heading)
+	{
+		int64_t first = min(first_heading, heading);
+		int64_t last = max(first_heading + (int64_t)step_x.size() - 1, heading);
+		// grow both ways by at least the current size so the cost is amortized
+		int64_t size = (int64_t)step_x.size();
+		if (heading < first_heading)
+			first = min(first, first_heading - size);
+		else
+			last = max(last, first_heading + 2 * size);
+		vector<double> grown_x(last - first + 1), grown_y(last - first + 1);
+		for (int64_t h = first; h <= last; h++) {
+			grown_x[h - first] = forward_distance * sin(h * angle_delta);
+			grown_y[h - first] = -forward_distance * cos(h * angle_delta);
+		}
+		first_heading = first;
+		step_x.swap(grown_x);
+		step_y.swap(grown_y);
+	}
+
+public:
+	int64_t period;
+
+	HeadingTable(double angle_delta, double forward_distance)
+		: angle_delta(angle_delta), forward_distance(forward_distance), period(heading_period(angle_delta))
+	{
+		extend(period > 0 ? period - 1 : 0);
+		extend(0);
+	}
+
+	int64_t turn(int64_t heading, int64_t turns) const
+	{
+		if (period == 0)
+			return heading + turns;
+		heading = (heading + turns) % period;
+		return heading < 0 ? heading + period : heading;
+	}
+
+	void step(int64_t heading, double &dx, double &dy)
+	{
+		if (heading < first_heading || heading >= first_heading + (int64_t)step_x.size())
+			extend(heading);
+		dx = step_x[heading - first_heading];
+		dy = step_y[heading - first_heading];
+	}
+};
+
+// coordinate policies for HeadingTurtle: a policy owns the step for every heading, decides what
+// positions accumulate in and writes them out as rank components of type Component per vertex
+
+struct DoubleCoordinates {
+	// the original arithmetic, positions accumulate in double and are stored as float
+	struct Position {
+		double x = 0;
+		double y = 0;
+		Position &operator+=(const Position &other) { x += other.x; y += other.y; return *this; }
+	};
+	typedef float Component;
+	static const int rank = 2;
+
+	HeadingTable table;
+	double angle_delta;
+
+	DoubleCoordinates(double angle_delta, double forward_distance)
+		: table(angle_delta, forward_distance), angle_delta(angle_delta) {}
+
+	int64_t turn(int64_t heading, int64_t turns) const { return table.turn(heading, turns); }
+
+	Position step(int64_t heading)
+	{
+		Position step;
+		table.step(heading, step.x, step.y);
+		return step;
+	}
+
+	Position rotate(const Position &position, int64_t turns) const
+	{
+		double theta = turns * angle_delta;
+		return {position.x * cos(theta) - position.y * sin(theta), position.x * sin(theta) + position.y * cos(theta)};
+	}
+
+	void write(const Position &position, Component *out) const
+	{
+		out[0] = +position.x;
+		out[1] = -position.y;
+	}
+
+	void plane(const Position &position, float &x, float &y) const
+	{
+		x = +position.x;
+		y = -position.y;
+	}
+};
+
+struct FloatCoordinates {
+	// positions accumulate in float, half the state of double at the cost of drifting sooner
+	struct Position {
+		float x = 0;
+		float y = 0;
+		Position &operator+=(const Position &other) { x += other.x; y += other.y; return *this; }
+	};
+	typedef float Component;
+	static const int rank = 2;
+
+	HeadingTable table;
+	double angle_delta;
+
+	FloatCoordinates(double angle_delta, double forward_distance)
+		: table(angle_delta, forward_distance), angle_delta(angle_delta) {}
+
+	int64_t turn(int64_t heading, int64_t turns) const { return table.turn(heading, turns); }
+
+	Position step(int64_t heading)
+	{
+		double dx, dy;
+		table.step(heading, dx, dy);
+		return {(float)dx, (float)dy};
+	}
+
+	Position rotate(const Position &position, int64_t turns) const
+	{
+		float theta = turns * angle_delta;
+		return {position.x * cosf(theta) - position.y * sinf(theta), position.x * sinf(theta) + position.y * cosf(theta)};
+	}
+
+	void write(const Position &position, Component *out) const
+	{
+		out[0] = +position.x;
+		out[1] = -position.y;
+	}
+
+	void plane(const Position &position, float &x, float &y) const
+	{
+		x = +position.x;
+		y = -position.y;
+	}
+};
+
+struct FixedCoordinates {
+	// positions accumulate in 64 bit fixed point with FIXED_POINT_FRACTION_BITS fractional bits, so
+	// the serial walk gives the same geometry on every platform and never loses precision far out
+	struct Position {
+		int64_t x = 0;
+		int64_t y = 0;
+		Position &operator+=(const Position &other) { x += other.x; y += other.y; return *this; }
+	};
+	typedef float Component;
+	static const int rank = 2;
+	static constexpr double one = (double)((int64_t)1 << FIXED_POINT_FRACTION_BITS);
+
+	HeadingTable table;
+	double angle_delta;
+
+	FixedCoordinates(double angle_delta, double forward_distance)
+		: table(angle_delta, forward_distance), angle_delta(angle_delta) {}
+
+	int64_t turn(int64_t heading, int64_t turns) const { return table.turn(heading, turns); }
+
+	Position step(int64_t heading)
+	{
+		double dx, dy;
+		table.step(heading, dx, dy);
+		return {llround(dx * one), llround(dy * one)};
+	}
+
+	Position rotate(const Position &position, int64_t turns) const
+	{
+		double theta = turns * angle_delta;
+		double x = (double)position.x;
+		double y = (double)position.y;
+		return {llround(x * cos(theta) - y * sin(theta)), llround(x * sin(theta) + y * cos(theta))};
+	}
+
+	void write(const Position &position, Component *out) const
+	{
+		out[0] = +(double)position.x / one;
+		out[1] = -(double)position.y / one;
+	}
+
+	void plane(const Position &position, float &x, float &y) const
+	{
+		x = +(double)position.x / one;
+		y = -(double)position.y / one;
+	}
+};
+
+vector<int64_t> cyclotomic_polynomial(int64_t n)
+{
+	// coefficients of the n-th cyclotomic polynomial, lowest degree first: x^n - 1 divided by
+	// the cyclotomic polynomials of the proper divisors of n
+	vector<int64_t> polynomial(n + 1, 0);
+	polynomial[0] = -1;
+	polynomial[n] = 1;
+	for (int64_t d = 1; d < n; d++) {
+		if (n % d)
+			continue;
+		vector<int64_t> divisor = cyclotomic_polynomial(d);
+		size_t degree = divisor.size() - 1;
+		vector<int64_t> quotient(polynomial.size() - degree, 0);
+		for (size_t i = quotient.size(); i-- > 0;) {
+			quotient[i] = polynomial[i + degree];
+			for (size_t k = 0; k <= degree; k++)
+				polynomial[i + k] -= quotient[i] * divisor[k];
+		}
+		polynomial.swap(quotient);
+	}
+	return polynomial;
+}
+
+struct CyclotomicLattice {
+	// exact positions for a turn angle of 2 pi m / n: every step is a power of zeta, a primitive
+	// n-th root of unity, and every position an integer combination of 1, zeta, ..., zeta^(rank - 1)
+	// with rank the degree of the n-th cyclotomic polynomial; n = 4 gives the square lattice and
+	// n = 3, 6 the Eisenstein integers, n = 8, 10, 12 cover the 45, 36 and 30 degree systems
+	int64_t n;
+	int64_t m;
+	int rank;
+	// zeta^e for e in [0, n)
+	vector<array<int64_t, 4>> powers;
+	// plane position of every basis element times forward_distance, as a column major mat4x2
+	float basis[8];
+
+	static bool build(double angle_delta, double forward_distance, CyclotomicLattice &lattice)
+	{
+		// false when the angle isn't a rational fraction of a full turn or needs more than four
+		// components per vertex
+		int64_t n = heading_period(angle_delta);
+		if (n == 0)
+			return false;
+		vector<int64_t> polynomial = cyclotomic_polynomial(n);
+		int rank = polynomial.size() - 1;
+		if (rank > 4)
+			return false;
+
+		lattice.n = n;
+		lattice.m = ((llround(angle_delta * n / (2 * M_PI)) % n) + n) % n;
+		lattice.rank = rank;
+		lattice.powers.assign(n, {0, 0, 0, 0});
+		// x^(e + 1) from x^e, folding x^rank back in with the (monic) cyclotomic polynomial
+		array<int64_t, 4> power = {0, 0, 0, 0};
+		power[0] = 1;
+		for (int64_t e = 0; e < n; e++) {
+			lattice.powers[e] = power;
+			int64_t top = power[rank - 1];
+			for (int k = rank - 1; k > 0; k--)
+				power[k] = power[k - 1] - top * polynomial[k];
+			power[0] = -top * polynomial[0];
+		}
+		// the turtle steps by (sin, cos) of its heading in plane coordinates, see DoubleCoordinates
+		for (int k = 0; k < 4; k++) {
+			lattice.basis[2 * k] = k < rank ? forward_distance * sin(2 * M_PI * k / n) : 0;
+			lattice.basis[2 * k + 1] = k < rank ? forward_distance * cos(2 * M_PI * k / n) : 0;
+		}
+		return true;
+	}
+
+	int64_t largest_coefficient() const
+	{
+		int64_t largest = 0;
+		for (const auto &power : powers)
+			for (int64_t coefficient : power)
+				largest = max(largest, coefficient < 0 ? -coefficient : coefficient);
+		return largest;
+	}
+};
+
+template <typename ComponentType>
+struct CyclotomicCoordinates {
+	// bit exact coordinates on a CyclotomicLattice, stored as integers; the caller picks a
+	// component type wide enough for the number of steps taken
+	struct Position {
+		int64_t c[4] = {0, 0, 0, 0};
+		Position &operator+=(const Position &other)
+		{
+			for (int k = 0; k < 4; k++)
+				c[k] += other.c[k];
+			return *this;
+		}
+	};
+	typedef ComponentType Component;
+
+	CyclotomicLattice lattice;
+	int rank;
+	// step for every heading, headings wrap around at n
+	vector<Position> steps;
+
+	CyclotomicCoordinates(const CyclotomicLattice &lattice) : lattice(lattice), rank(lattice.rank), steps(lattice.n)
+	{
+		for (int64_t heading = 0; heading < lattice.n; heading++)
+			copy(lattice.powers[heading * lattice.m % lattice.n].begin(), lattice.powers[heading * lattice.m % lattice.n].end(), steps[heading].c);
+	}
+
+	int64_t turn(int64_t heading, int64_t turns) const
+	{
+		heading = (heading + turns) % lattice.n;
+		return heading < 0 ? heading + lattice.n : heading;
+	}
+
+	Position step(int64_t heading) const { return steps[heading]; }
+
+	Position rotate(const Position &position, int64_t turns) const
+	{
+		// multiply by zeta^(m * turns), term by term through the table of powers
+		int64_t e = turn(0, turns) * lattice.m % lattice.n;
+		Position rotated;
+		for (int k = 0; k < rank; k++) {
+			const auto &power = lattice.powers[(k + e) % lattice.n];
+			for (int j = 0; j < rank; j++)
+				rotated.c[j] += position.c[k] * power[j];
+		}
+		return rotated;
+	}
+
+	void write(const Position &position, Component *out) const
+	{
+		for (int k = 0; k < rank; k++)
+			out[k] = (Component)position.c[k];
+	}
+
+	void plane(const Position &position, float &x, float &y) const
+	{
+		double plane_x = 0, plane_y = 0;
+		for (int k = 0; k < rank; k++) {
+			plane_x += lattice.basis[2 * k] * (double)position.c[k];
+			plane_y += lattice.basis[2 * k + 1] * (double)position.c[k];
+		}
+		x = plane_x;
+		y = plane_y;
+	}
+};
+
+template <typename Coordinates>
+struct HeadingTurtle {
+	// turtle for a fixed turn angle, same output as Turtle without any trigonometry per instruction:
+	// the heading is an integer number of turns and every step comes from the coordinate policy;
+	// vertices are written through out, which must have room for two per F still to come, or as
+	// line strips with strips set
+	typedef typename Coordinates::Position Position;
+	typedef typename Coordinates::Component Component;
+	Coordinates coordinates;
+	Component *out;
+	bool strips = false;
+	bool strip_open = false;
+	BoundsTracker bounds;
+
+	Position position;
+	int64_t heading = 0;
+	struct State {
+		Position position;
+		int64_t heading;
+	};
+	vector<State> saved_position;
+
+	HeadingTurtle(const Coordinates &coordinates, Component *out)
+		: coordinates(coordinates), out(out) {}
+
+	void write()
+	{
+		if (bounds.bounds) {
+			float x, y;
+			coordinates.plane(position, x, y);
+			bounds.add(out, x, y);
+		}
+		coordinates.write(position, out);
+		out += coordinates.rank;
+	}
+
+	void run(char instruction)
+	{
+		switch (instruction) {
+			case 'F':
+				if (!strips || !strip_open) {
+					write();
+					strip_open = strips;
+				}
+				position += coordinates.step(heading);
+				write();
+				break;
+			case '-': heading = coordinates.turn(heading, -1); break;
+			case '+': heading = coordinates.turn(heading, +1); break;
+			case '[': saved_position.push_back({position, heading}); break;
+			case ']':
+				position = saved_position.back().position;
+				heading = saved_position.back().heading;
+				saved_position.pop_back();
+				strip_open = false;
+				break;
+			default: break;
+		}
+	}
+};
+
+size_t count_forward(const char *instructions, size_t size)
+{
+	// number of F in instructions, 16 bytes at a time where SSE2 is available; this is the
+	// counting pass that sizes turtle output exactly before any of it is written
+	size_t count = 0;
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i forward = _mm_set1_epi8('F');
+	for (; i + 16 <= size; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(instructions + i));
+		count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, forward)));
+	}
+#endif
+	for (; i < size; i++)
+		count += instructions[i] == 'F';
+	return count;
+}
+
+// draw ranges of the line strips a turtle writes with strips set: a strip starts at the first F
+// after a ']' (or the start) and runs up to the next ']', since that is the only instruction that
+// makes the turtle jump, so branches carry on the strip of their parent until they are popped
+struct StripRanges {
+	vector<GLint> first;
+	vector<GLsizei> count;
+	size_t num_vertices = 0;
+	// whether the last strip is still open at the end of what has been added so far
+	bool open = false;
+
+	void add(const char *instructions, size_t size)
+	{
+		// extend the ranges by the next piece of instructions, so they can be built block by block
+		const char *end = instructions + size;
+		while (instructions < end) {
+			const char *pop = (const char *)memchr(instructions, ']', end - instructions);
+			const char *segment_end = pop ? pop : end;
+			size_t forward_count = count_forward(instructions, segment_end - instructions);
+			if (forward_count > 0) {
+				if (!open) {
+					first.push_back(num_vertices);
+					count.push_back(1);
+					num_vertices++;
+					open = true;
+				}
+				count.back() += forward_count;
+				num_vertices += forward_count;
+			}
+			if (pop)
+				open = false;
+			instructions = pop ? pop + 1 : end;
+		}
+	}
+};
+
+// rigid transform a piece of bracket free instructions applies to the turtle, as seen from the
+// origin facing heading 0
+template <typename Coordinates>
+struct TurtleTransform {
+	typename Coordinates::Position position;
+	int64_t turns = 0;
+	size_t forward_count = 0;
+};
+
+template <typename Coordinates>
+void generate_lines_parallel(const string &instructions, const Coordinates &coordinates, ThreadPool &pool, typename Coordinates::Component *out, ChunkBounds *bounds, bool strips)
+{
+	// turtle interpretation of bracket free instructions split into chunks across the pool: every
+	// chunk is reduced to the transform it applies, a serial scan over those composes the turtle
+	// state at the start of every chunk and the number of lines before it, then every chunk runs
+	// the turtle from its own start state into its own range of the output; as line strips the
+	// instructions are a single strip, which every chunk after its first line continues
+	size_t num_chunks = pool.size() * 4;
+	size_t chunk_size = (instructions.size() + num_chunks - 1) / num_chunks;
+	vector<TurtleTransform<Coordinates>> transforms(num_chunks);
+	pool.parallel_for(num_chunks, [&](size_t chunk) {
+		Coordinates steps = coordinates;
+		TurtleTransform<Coordinates> transform;
+		size_t end = min(instructions.size(), (chunk + 1) * chunk_size);
+		for (size_t i = chunk * chunk_size; i < end; i++) {
+			switch (instructions[i]) {
+				case 'F':
+					transform.position += steps.step(steps.turn(0, transform.turns));
+					transform.forward_count++;
+					break;
+				case '-': transform.turns--; break;
+				case '+': transform.turns++; break;
+				default: break;
+			}
+		}
+		transforms[chunk] = transform;
+	});
+
+	// exclusive scan, rotating every chunk's translation by the heading it starts at
+	vector<TurtleTransform<Coordinates>> starts(num_chunks);
+	TurtleTransform<Coordinates> state;
+	for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+		starts[chunk] = state;
+		const TurtleTransform<Coordinates> &transform = transforms[chunk];
+		state.position += coordinates.rotate(transform.position, state.turns);
+		state.turns += transform.turns;
+		state.forward_count += transform.forward_count;
+	}
+
+	pool.parallel_for(num_chunks, [&](size_t chunk) {
+		size_t lines_before = starts[chunk].forward_count;
+		size_t vertices_before = strips ? (lines_before > 0 ? 1 + lines_before : 0) : 2 * lines_before;
+		HeadingTurtle<Coordinates> turtle(coordinates, out + coordinates.rank * vertices_before);
+		turtle.bounds.start(bounds, out, coordinates.rank * sizeof(*out));
+		turtle.strips = strips;
+		turtle.strip_open = strips && lines_before > 0;
+		turtle.position = starts[chunk].position;
+		turtle.heading = coordinates.turn(0, starts[chunk].turns);
+		size_t end = min(instructions.size(), (chunk + 1) * chunk_size);
+		for (size_t i = chunk * chunk_size; i < end; i++)
+			turtle.run(instructions[i]);
+	});
+}
+
+// bracket pair far enough apart to be worth a task of its own, with the number of lines drawn
+// before each of its brackets
+struct BranchRange {
+	size_t open;
+	size_t close;
+	size_t lines_before_open;
+	size_t lines_before_close;
+};
+
+bool find_parallel_branches(const string &instructions, ThreadPool &pool, vector<BranchRange> &branches)
+{
+	// match brackets chunk by chunk in parallel keeping the pairs at least PARALLEL_BRANCH_MIN_BYTES
+	// apart, brackets left unmatched inside their chunk are matched by a serial pass over the chunks
+	// in order; false if the brackets don't balance
+	size_t num_chunks = pool.size() * 4;
+	size_t chunk_size = (instructions.size() + num_chunks - 1) / num_chunks;
+	struct ChunkBrackets {
+		vector<BranchRange> pairs;
+		vector<size_t> unmatched_close;
+		vector<size_t> unmatched_open;
+		size_t forward_count;
+	};
+	vector<ChunkBrackets> chunks(num_chunks);
+	pool.parallel_for(num_chunks, [&](size_t chunk) {
+		ChunkBrackets &brackets = chunks[chunk];
+		size_t forwards = 0;
+		size_t end = min(instructions.size(), (chunk + 1) * chunk_size);
+		for (size_t i = chunk * chunk_size; i < end; i++) {
+			switch (instructions[i]) {
+				case 'F': forwards++; break;
+				case '[': brackets.unmatched_open.push_back(i); break;
+				case ']':
+					if (brackets.unmatched_open.empty()) {
+						brackets.unmatched_close.push_back(i);
+					} else {
+						if (i - brackets.unmatched_open.back() >= PARALLEL_BRANCH_MIN_BYTES)
+							brackets.pairs.push_back({brackets.unmatched_open.back(), i, 0, 0});
+						brackets.unmatched_open.pop_back();
+					}
+					break;
+				default: break;
+			}
+		}
+		brackets.forward_count = forwards;
+	});
+
+	vector<size_t> open;
+	vector<size_t> chunk_lines(num_chunks + 1, 0);
+	branches.clear();
+	for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+		ChunkBrackets &brackets = chunks[chunk];
+		branches.insert(branches.end(), brackets.pairs.begin(), brackets.pairs.end());
+		for (size_t close : brackets.unmatched_close) {
+			if (open.empty())
+				return false;
+			if (close - open.back() >= PARALLEL_BRANCH_MIN_BYTES)
+				branches.push_back({open.back(), close, 0, 0});
+			open.pop_back();
+		}
+		open.insert(open.end(), brackets.unmatched_open.begin(), brackets.unmatched_open.end());
+		chunk_lines[chunk + 1] = chunk_lines[chunk] + brackets.forward_count;
+	}
+	if (!open.empty())
+		return false;
+	sort(branches.begin(), branches.end(), [](const BranchRange &a, const BranchRange &b) { return a.open < b.open; });
+
+	// count the lines before every bracket of the kept pairs, chunk by chunk from the chunk's offset
+	vector<pair<size_t, size_t *>> marks;
+	for (BranchRange &branch : branches) {
+		marks.push_back({branch.open, &branch.lines_before_open});
+		marks.push_back({branch.close, &branch.lines_before_close});
+	}
+	sort(marks.begin(), marks.end());
+	pool.parallel_for(num_chunks, [&](size_t chunk) {
+		size_t begin = chunk * chunk_size;
+		size_t end = min(instructions.size(), begin + chunk_size);
+		auto mark = lower_bound(marks.begin(), marks.end(), make_pair(begin, (size_t *)nullptr));
+		size_t lines = chunk_lines[chunk];
+		for (size_t i = begin; i < end && mark != marks.end(); i++) {
+			for (; mark != marks.end() && mark->first == i; ++mark)
+				*mark->second = lines;
+			lines += instructions[i] == 'F';
+		}
+	});
+	return true;
+}
+
+template <typename Coordinates>
+bool generate_lines_branches(const string &instructions, const Coordinates &coordinates, ThreadPool &pool, typename Coordinates::Component *out, ChunkBounds *bounds)
+{
+	// turtle interpretation of bracketed instructions with every long enough branch as a task of its
+	// own: a branch only depends on the turtle state at its '[', so its parent spawns it and skips
+	// straight to the matching ']', and since the lines before every bracket are known each task
+	// writes to the same place in the output the serial walk would; false if the brackets don't balance
+	vector<BranchRange> branches;
+	if (!find_parallel_branches(instructions, pool, branches))
+		return false;
+
+	struct BranchTask {
+		size_t begin;
+		size_t end;
+		typename Coordinates::Position position;
+		int64_t heading;
+		size_t lines_before;
+	};
+	auto first_branch_after = [&](size_t position) {
+		return lower_bound(branches.begin(), branches.end(), position,
+			[](const BranchRange &branch, size_t position) { return branch.open < position; }) - branches.begin();
+	};
+
+	WorkStealingScheduler<BranchTask> scheduler(pool.size());
+	scheduler.spawn(0, {0, instructions.size(), typename Coordinates::Position(), 0, 0});
+	scheduler.run(pool, [&](size_t worker, BranchTask &task) {
+		HeadingTurtle<Coordinates> turtle(coordinates, out + 2 * coordinates.rank * task.lines_before);
+		turtle.bounds.start(bounds, out, coordinates.rank * sizeof(*out));
+		turtle.position = task.position;
+		turtle.heading = task.heading;
+		size_t next = first_branch_after(task.begin);
+		for (size_t i = task.begin; i < task.end; i++) {
+			if (next < branches.size() && branches[next].open == i) {
+				const BranchRange &branch = branches[next];
+				scheduler.spawn(worker, {branch.open + 1, branch.close, turtle.position, turtle.heading, branch.lines_before_open});
+				i = branch.close;
+				turtle.out = out + 2 * coordinates.rank * branch.lines_before_close;
+				next = first_branch_after(branch.close);
+				continue;
+			}
+			turtle.run(instructions[i]);
+		}
+	});
+	return true;
+}
+
+template <typename Coordinates>
+bool generate_lines(const string &instructions, const Coordinates &coordinates, typename Coordinates::Component *out, ChunkBounds *bounds, bool strips, const function<bool(size_t)> &progress = nullptr)
+{
+    // run thrugh the insturction string one character at a time and run the character as an insturction
+    // writes lines through out serialized in order x1, y1, x2, y2, out must have room for
+    // 2 * count_forward(instructions) vertices; with strips set it writes the line strips of
+    // StripRanges instead; bounds is optional, and so is progress, which is told how many vertices
+    // are written every PROGRESSIVE_CHUNK_VERTICES or so on this thread and stops the turtle when
+    // it returns false, in which case so does this
+	ThreadPool &pool = thread_pool();
+	if (instructions.size() >= PARALLEL_TURTLE_MIN_BYTES && pool.size() > 1) {
+		if (!memchr(instructions.data(), '[', instructions.size()) && !memchr(instructions.data(), ']', instructions.size())) {
+			generate_lines_parallel(instructions, coordinates, pool, out, bounds, strips);
+			return true;
+		}
+		// branch tasks only know the number of lines before their brackets, not the number of
+		// strips, so bracketed line strips stay on this thread
+		if (!strips && generate_lines_branches(instructions, coordinates, pool, out, bounds))
+			return true;
+	}
+
+	HeadingTurtle<Coordinates> turtle(coordinates, out);
+	turtle.bounds.start(bounds, out, coordinates.rank * sizeof(*out));
+	turtle.strips = strips;
+	size_t reported = 0;
+	for (size_t begin = 0; begin < instructions.size(); begin += 4096) {
+		size_t end = min(instructions.size(), begin + 4096);
+		for (size_t i = begin; i < end; i++)
+			turtle.run(instructions[i]);
+		size_t written = (turtle.out - out) / coordinates.rank;
+		if (progress && written - reported >= PROGRESSIVE_CHUNK_VERTICES) {
+			if (!progress(written))
+				return false;
+			reported = written;
+		}
+	}
+	return true;
+}
+
+vector<float> generate_lines(const string &instructions, double angle_delta, double forward_distance)
+{
+	// same as above into a vector sized by the counting pass
+	vector<float> out_buffer(4 * count_forward(instructions.data(), instructions.size()));
+	generate_lines(instructions, TURTLE_COORDINATES(angle_delta, forward_distance), out_buffer.data(), nullptr, false);
+	return out_buffer;
+}
+
+void generate_parametric_lines(const ModuleString &modules, double angle_delta, double forward_distance, float *out, ChunkBounds *bounds, bool strips)
+{
+	// turtle over a module string, F(l) moves l times forward_distance and +(a) / -(a) turn by a
+	// degrees, modules without parameters behave as in generate_lines
+	Turtle turtle(angle_delta, forward_distance, out);
+	turtle.bounds.start(bounds, out, 2 * sizeof(float));
+	turtle.strips = strips;
+	for (size_t i = 0; i < modules.symbols.size(); i++) {
+		char symbol = modules.symbols[i];
+		bool has_parameter = modules.num_parameters(i) > 0;
+		double parameter = has_parameter ? modules.parameters[modules.first_parameter[i]] : 0;
+		if (symbol == 'F')
+			turtle.forward_distance = has_parameter ? parameter * forward_distance : forward_distance;
+		else if (symbol == '+' || symbol == '-')
+			turtle.angle_delta = has_parameter ? parameter * M_PI / 180 : angle_delta;
+		turtle.run(symbol);
+	}
+}
+
+size_t count_forward_streamed(const CompiledLsystem &system, size_t num_iterations)
+{
+	// number of F in the n-th derivation, predicted for deterministic grammars and counted from
+	// a DerivationStream otherwise
+	if (system.is_deterministic())
+		return predict_derivation_size(system, num_iterations).forward_count;
+	DerivationStream stream(system, num_iterations);
+	char block[4096];
+	size_t count, forward_count = 0;
+	while ((count = stream.next_block(block, sizeof(block))) > 0)
+		forward_count += count_forward(block, count);
+	return forward_count;
+}
+
+StripRanges strip_ranges_streamed(const CompiledLsystem &system, size_t num_iterations)
+{
+	// line strips of the n-th derivation, built from a DerivationStream
+	StripRanges ranges;
+	DerivationStream stream(system, num_iterations);
+	char block[4096];
+	size_t count;
+	while ((count = stream.next_block(block, sizeof(block))) > 0)
+		ranges.add(block, count);
+	return ranges;
+}
+
+template <typename Coordinates>
+bool generate_lines_streamed(const CompiledLsystem &system, size_t num_iterations, const Coordinates &coordinates, typename Coordinates::Component *out, ChunkBounds *bounds, bool strips, const function<bool(size_t)> &progress)
+{
+	// same as generate_lines on the n-th derivation, pulling the instructions from a
+	// DerivationStream in small blocks instead of materializing the whole string
+	// out must have room for 2 * count_forward_streamed(system, num_iterations) vertices, or the
+	// vertices of strip_ranges_streamed with strips set; progress is optional and is told how many
+	// vertices are written every PROGRESSIVE_CHUNK_VERTICES or so, the turtle stops when it
+	// returns false and so does this
+	HeadingTurtle<Coordinates> turtle(coordinates, out);
+	turtle.bounds.start(bounds, out, coordinates.rank * sizeof(*out));
+	turtle.strips = strips;
+	DerivationStream stream(system, num_iterations);
+	char block[4096];
+	size_t count;
+	size_t reported = 0;
+	while ((count = stream.next_block(block, sizeof(block))) > 0) {
+		for (size_t i = 0; i < count; i++)
+			turtle.run(block[i]);
+		size_t written = (turtle.out - out) / coordinates.rank;
+		if (progress && written - reported >= PROGRESSIVE_CHUNK_VERTICES) {
+			// the last vertex may still be the start of a strip that has no segment yet, which
+			// draws nothing either way
+			if (!progress(written))
+				return false;
+			reported = written;
+		}
+	}
+	return true;
+}
+
+class DerivationHistory {
+	// derivation levels of every fractal that has been shown, so stepping the iteration count up
+	// costs a single rewrite pass and stepping down costs nothing; the largest levels are evicted
+	// first whenever the total goes over the budget
+	typedef pair<size_t, size_t> Key;
+	uint64_t budget;
+	map<Key, string> derivations;
+
+	void evict(uint64_t limit, const vector<Key> &keep)
+	{
+		// drop the largest levels not in use until the history takes at most limit bytes
+		uint64_t total = 0;
+		for (const auto &entry : derivations)
+			total += entry.second.capacity();
+		while (total > limit) {
+			auto largest = derivations.end();
+			for (auto it = derivations.begin(); it != derivations.end(); ++it) {
+				if ((largest == derivations.end() || it->second.capacity() > largest->second.capacity())
+					&& find(keep.begin(), keep.end(), it->first) == keep.end())
+					largest = it;
+			}
+			if (largest == derivations.end())
+				return;
+			total -= largest->second.capacity();
+			derivations.erase(largest);
+		}
+	}
+
+public:
+	DerivationHistory(uint64_t budget) : budget(budget) {}
+
+	const string &derivation(size_t fractal, const CompiledLsystem &system, size_t level, const function<bool()> &cancelled = nullptr)
+	{
+		// the level is reused when it is still around, rewritten once from the level below when
+		// that one is, and flattened from the DAG otherwise; once cancelled (optional) returns
+		// true the level is dropped half done and an empty derivation comes back
+		static const string cancelled_derivation;
+		Key key(fractal, level);
+		auto cached = derivations.find(key);
+		if (cached != derivations.end())
+			return cached->second;
+
+		Key previous(fractal, level - 1);
+		bool from_previous = level > 0 && derivations.count(previous);
+		uint64_t needed = predict_derivation_size(system, level).length;
+		evict(budget > needed ? budget - needed : 0, from_previous ? vector<Key>{previous} : vector<Key>{});
+
+		string &out = derivations[key];
+		if (from_previous)
+			run_step(system, derivations[previous], out, level - 1);
+		else if (system.is_deterministic())
+			out = DerivationDag(system, level).flatten();
+		else
+			out = generate_lsystem(system, level, cancelled);
+		if (cancelled && cancelled()) {
+			derivations.erase(key);
+			return cancelled_derivation;
+		}
+		return out;
+	}
+};
+
+// cut levels: a level cut depth rewrites above the bottom is the derivation of level - depth with
+// every symbol replaced by its expansion after depth rewrites, so its lines are the lines of every
+// distinct expansion placed at each occurrence of its symbol by the rigid transform the turtle is
+// in when it gets there; instancing places them on the gpu and composition on the cpu
+
+bool can_instance(const CompiledLsystem &system)
+{
+	// every occurrence of (symbol, depth) has to expand the same way, and every expansion has to
+	// leave the bracket stack as it found it so what comes after it only sees its net transform
+	if (system.parametric || !system.is_deterministic())
+		return false;
+	for (char bracket : {'[', ']'}) {
+		if (system.symbol_ids[(unsigned char)bracket] < system.alphabet.size() && !system.production(bracket).is_constant)
+			return false;
+	}
+	for (const Production &production : system.productions) {
+		if (production.is_constant)
+			continue;
+		int64_t depth = 0;
+		for (uint32_t k = 0; k < production.length && depth >= 0; k++) {
+			char c = system.replacement_pool[production.offset + k];
+			depth += c == '[' ? 1 : c == ']' ? -1 : 0;
+		}
+		if (depth != 0)
+			return false;
+	}
+	return true;
+}
+
+struct InstancingPlan {
+	size_t depth = 0;
+	// bytes of the cut derivation, the expansions, their lines and the transforms
+	uint64_t footprint = UINT64_MAX;
+};
+
+InstancingPlan plan_instancing(const CompiledLsystem &system, size_t level)
+{
+	// depth with the smallest footprint: deeper cuts have fewer occurrences to place but larger
+	// expansions to draw, both are read off powers of the growth matrix
+	size_t size = system.alphabet.size();
+	size_t forward = system.symbol_ids['F'];
+	GrowthMatrix growth = growth_matrix(system);
+	vector<vector<uint64_t>> occurrences(level + 1, vector<uint64_t>(size, 0));
+	for (char c : system.axiom)
+		occurrences[0][system.symbol_ids[(unsigned char)c]] += 1;
+	for (size_t k = 1; k <= level; k++)
+		occurrences[k] = multiply(occurrences[k - 1], growth);
+
+	// rows of growth to the power depth, the symbols every symbol expands to after depth rewrites
+	GrowthMatrix expansion = {size, vector<uint64_t>(size * size, 0)};
+	for (size_t i = 0; i < size; i++)
+		expansion.at(i, i) = 1;
+	InstancingPlan best;
+	for (size_t depth = 0; depth <= level; depth++) {
+		const vector<uint64_t> &cut = occurrences[level - depth];
+		uint64_t footprint = 0;
+		for (size_t i = 0; i < size; i++) {
+			if (cut[i] == 0)
+				continue;
+			footprint = saturating_add(footprint, cut[i]);
+			for (size_t j = 0; j < size; j++)
+				footprint = saturating_add(footprint, expansion.at(i, j));
+			uint64_t forward_count = forward < size ? expansion.at(i, forward) : 0;
+			if (forward_count > 0) {
+				footprint = saturating_add(footprint, saturating_mul(forward_count, 2 * 2 * sizeof(float)));
+				footprint = saturating_add(footprint, saturating_mul(cut[i], 4 * sizeof(float)));
+			}
+		}
+		if (footprint < best.footprint)
+			best = {depth, footprint};
+		expansion = multiply(expansion, growth);
+	}
+	return best;
+}
+
+size_t admissible_instanced_iterations(const CompiledLsystem &system, size_t num_iterations, uint64_t budget)
+{
+	while (num_iterations > 0 && plan_instancing(system, num_iterations).footprint > budget)
+		num_iterations--;
+	return num_iterations;
+}
+
+vector<string> cut_expansions(const CompiledLsystem &system, const string &cut, size_t depth)
+{
+	// expansion after depth rewrites of every symbol id occurring in cut, empty for the others
+	vector<string> expansions(system.alphabet.size() + 1);
+	vector<bool> occurs(system.alphabet.size() + 1, false);
+	for (char c : cut)
+		occurs[system.symbol_ids[(unsigned char)c]] = true;
+	CompiledLsystem single = system;
+	for (size_t id = 0; id < system.alphabet.size(); id++) {
+		if (!occurs[id])
+			continue;
+		single.axiom = string(1, system.alphabet[id]);
+		expansions[id] = DerivationDag(single, depth).flatten();
+	}
+	return expansions;
+}
+
+bool has_avx()
+{
+#if defined(__AVX__)
+	return true;
+#elif defined(RUNTIME_AVX)
+	static const bool supported = __builtin_cpu_supports("avx");
+	return supported;
+#else
+	return false;
+#endif
+}
+
+#if defined(__AVX__) || defined(RUNTIME_AVX)
+#ifdef RUNTIME_AVX
+__attribute__((target("avx")))
+#endif
+size_t transform_vertices_avx(const float *in, size_t count, float c, float s, float x, float y, float *out, Box &lanes)
+{
+	// the part of transform_vertices four vertices at a time, returns how many vertices are done
+	size_t i = 0;
+	const __m256 cos_lanes = _mm256_set1_ps(c);
+	const __m256 sin_lanes = _mm256_setr_ps(s, -s, s, -s, s, -s, s, -s);
+	const __m256 offset_lanes = _mm256_setr_ps(x, y, x, y, x, y, x, y);
+	__m256 low = _mm256_set1_ps(INFINITY);
+	__m256 high = _mm256_set1_ps(-INFINITY);
+	for (; i + 4 <= count; i += 4) {
+		__m256 vertices = _mm256_loadu_ps(in + 2 * i);
+		__m256 swapped = _mm256_permute_ps(vertices, _MM_SHUFFLE(2, 3, 0, 1));
+		__m256 moved = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cos_lanes, vertices), _mm256_mul_ps(sin_lanes, swapped)), offset_lanes);
+		_mm256_storeu_ps(out + 2 * i, moved);
+		low = _mm256_min_ps(low, moved);
+		high = _mm256_max_ps(high, moved);
+	}
+	float low_out[8], high_out[8];
+	_mm256_storeu_ps(low_out, low);
+	_mm256_storeu_ps(high_out, high);
+	for (int k = 0; k < 8; k += 2)
+		extend_box(lanes, {low_out[k], low_out[k + 1], high_out[k], high_out[k + 1]});
+	return i;
+}
+#endif
+
+void transform_vertices(const float *in, size_t count, float c, float s, float x, float y, float *out, Box &box)
+{
+	// out = in rotated by (c, s) the way a heading turn rotates plane coordinates and moved by
+	// (x, y), growing box to cover it; four vertices at a time with AVX where the cpu has it, two
+	// with SSE for what is left
+	size_t i = 0;
+	Box lanes = empty_box;
+#if defined(__AVX__) || defined(RUNTIME_AVX)
+	if (has_avx())
+		i = transform_vertices_avx(in, count, c, s, x, y, out, lanes);
+#endif
+#if defined(__SSE2__)
+	const __m128 cos_lanes = _mm_set1_ps(c);
+	const __m128 sin_lanes = _mm_setr_ps(s, -s, s, -s);
+	const __m128 offset_lanes = _mm_setr_ps(x, y, x, y);
+	__m128 low = _mm_set1_ps(INFINITY);
+	__m128 high = _mm_set1_ps(-INFINITY);
+	for (; i + 2 <= count; i += 2) {
+		__m128 vertices = _mm_loadu_ps(in + 2 * i);
+		__m128 swapped = _mm_shuffle_ps(vertices, vertices, _MM_SHUFFLE(2, 3, 0, 1));
+		__m128 moved = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cos_lanes, vertices), _mm_mul_ps(sin_lanes, swapped)), offset_lanes);
+		_mm_storeu_ps(out + 2 * i, moved);
+		low = _mm_min_ps(low, moved);
+		high = _mm_max_ps(high, moved);
+	}
+	float low_out[4], high_out[4];
+	_mm_storeu_ps(low_out, low);
+	_mm_storeu_ps(high_out, high);
+	for (int k = 0; k < 4; k += 2)
+		extend_box(lanes, {low_out[k], low_out[k + 1], high_out[k], high_out[k + 1]});
+#endif
+	for (; i < count; i++) {
+		float moved_x = c * in[2 * i] + s * in[2 * i + 1] + x;
+		float moved_y = -s * in[2 * i] + c * in[2 * i + 1] + y;
+		out[2 * i] = moved_x;
+		out[2 * i + 1] = moved_y;
+		extend_box(lanes, moved_x, moved_y);
+	}
+	if (count > 0)
+		extend_box(box, lanes);
+}
+
+// a level built on the cpu from a cut level: the lines of every expansion are run through the
+// turtle once and copied to each occurrence through its transform, so only the cut level is
+// interpreted character by character
+struct ComposedLines {
+	// indexed by symbol id: the vertices of the expansion from the origin facing heading 0 (as
+	// line strips with strips set, starting with the strip closed)
+	vector<vector<float>> lines;
+	// copy of lines[id] starting at vertex skip to vertex first of the output
+	struct Placement {
+		uint64_t first;
+		uint32_t id;
+		uint32_t skip;
+		float x, y;
+		float cos_theta, sin_theta;
+	};
+	vector<Placement> placements;
+};
+
+bool prepare_composition(DerivationHistory &history, size_t fractal, const CompiledLsystem &system, size_t level, double forward_distance, bool strips, ComposedLines &composed, StripRanges &ranges, size_t &num_vertices, const function<bool()> &cancelled = nullptr)
+{
+	// counting pass of a composed level: runs the expansions, then walks the cut level for where
+	// every occurrence lands in the output and, with strips, the strip ranges of the whole level;
+	// false when the system can't be cut
+	if (!can_instance(system))
+		return false;
+	size_t depth = plan_instancing(system, level).depth;
+	const string &cut = history.derivation(fractal, system, level - depth, cancelled);
+	vector<string> expansions = cut_expansions(system, cut, depth);
+
+	size_t size = expansions.size();
+	composed.lines.assign(size, {});
+	vector<StripRanges> local(size);
+	vector<double> end_x(size, 0), end_y(size, 0);
+	vector<int64_t> turns(size, 0);
+	// with strips: whether the first vertex carries on a strip left open before the expansion, and
+	// whether the expansion has a ']' after which the strip state no longer depends on what came before
+	vector<bool> joins(size, false), pops(size, false);
+	DoubleCoordinates coordinates(system.angle, forward_distance);
+	for (size_t id = 0; id < size; id++) {
+		const string &expansion = expansions[id];
+		if (expansion.empty() || expansion == "[" || expansion == "]")
+			continue;
+		if (strips)
+			local[id].add(expansion.data(), expansion.size());
+		else
+			local[id].num_vertices = 2 * count_forward(expansion.data(), expansion.size());
+		composed.lines[id].resize(2 * local[id].num_vertices);
+		HeadingTurtle<DoubleCoordinates> turtle(coordinates, composed.lines[id].data());
+		turtle.strips = strips;
+		for (char c : expansion)
+			turtle.run(c);
+		end_x[id] = turtle.position.x;
+		end_y[id] = -turtle.position.y;
+		turns[id] = turtle.heading;
+		size_t pop = expansion.find(']');
+		size_t forward = expansion.find('F');
+		joins[id] = forward != string::npos && (pop == string::npos || forward < pop);
+		pops[id] = pop != string::npos;
+	}
+
+	int64_t period = heading_period(system.angle);
+	struct State {
+		double x, y;
+		int64_t heading;
+	};
+	State state = {0, 0, 0};
+	vector<State> saved_state;
+	uint64_t vertex = 0;
+	ranges.open = false;
+	for (char c : cut) {
+		if (c == '[') {
+			saved_state.push_back(state);
+			continue;
+		}
+		if (c == ']') {
+			state = saved_state.back();
+			saved_state.pop_back();
+			ranges.open = false;
+			continue;
+		}
+		size_t id = system.symbol_ids[(unsigned char)c];
+		const StripRanges &strip = local[id];
+		if (strip.num_vertices == 0 && end_x[id] == 0 && end_y[id] == 0) {
+			state.heading = coordinates.turn(state.heading, turns[id]);
+			continue;
+		}
+		double theta = period > 0 ? (state.heading % period) * system.angle : state.heading * system.angle;
+		double cos_theta = cos(theta);
+		double sin_theta = sin(theta);
+		if (strip.num_vertices > 0) {
+			// an open strip already ends where the expansion starts, so its first vertex is dropped
+			// and its first strip carries on the open one
+			uint32_t skip = strips && ranges.open && joins[id] ? 1 : 0;
+			composed.placements.push_back({vertex, (uint32_t)id, skip, (float)state.x, (float)state.y, (float)cos_theta, (float)sin_theta});
+			for (size_t k = 0; k < strip.first.size(); k++) {
+				if (k == 0 && skip) {
+					ranges.count.back() += strip.count[0] - 1;
+					continue;
+				}
+				ranges.first.push_back(vertex - skip + strip.first[k]);
+				ranges.count.push_back(strip.count[k]);
+			}
+			vertex += strip.num_vertices - skip;
+			ranges.open = pops[id] ? strip.open : ranges.open || strip.open;
+		}
+		state.x += cos_theta * end_x[id] + sin_theta * end_y[id];
+		state.y += -sin_theta * end_x[id] + cos_theta * end_y[id];
+		state.heading = coordinates.turn(state.heading, turns[id]);
+	}
+	ranges.num_vertices = vertex;
+	num_vertices = vertex;
+	return true;
+}
+
+void compose_placements(const ComposedLines &composed, size_t begin, size_t end, uint64_t first_vertex, uint64_t end_vertex, float *out, ChunkBounds *bounds)
+{
+	// copy placements [begin, end), which write vertices [first_vertex, end_vertex), through their
+	// transforms, split across the pool by output vertices; each task keeps the box of the run it
+	// is writing and merges it when it moves on, like BoundsTracker
+	ThreadPool &pool = thread_pool();
+	size_t num_tasks = (end_vertex - first_vertex) * 2 * sizeof(float) >= PARALLEL_TURTLE_MIN_BYTES ? 4 * pool.size() : 1;
+	vector<size_t> task_begin(num_tasks + 1);
+	for (size_t task = 0; task < num_tasks; task++) {
+		uint64_t vertex = first_vertex + (end_vertex - first_vertex) * task / num_tasks;
+		task_begin[task] = lower_bound(composed.placements.begin() + begin, composed.placements.begin() + end, vertex,
+			[](const ComposedLines::Placement &placement, uint64_t v) { return placement.first < v; }) - composed.placements.begin();
+	}
+	task_begin[0] = begin;
+	task_begin[num_tasks] = end;
+	pool.parallel_for(num_tasks, [&](size_t task) {
+		Box box = empty_box;
+		size_t chunk = SIZE_MAX;
+		for (size_t p = task_begin[task]; p < task_begin[task + 1]; p++) {
+			const ComposedLines::Placement &placement = composed.placements[p];
+			const vector<float> &lines = composed.lines[placement.id];
+			const float *in = lines.data() + 2 * placement.skip;
+			uint64_t vertex = placement.first;
+			size_t count = lines.size() / 2 - placement.skip;
+			while (count > 0) {
+				size_t piece_chunk = vertex / CULL_CHUNK_VERTICES;
+				size_t piece = min<uint64_t>(count, (piece_chunk + 1) * CULL_CHUNK_VERTICES - vertex);
+				if (piece_chunk != chunk) {
+					if (bounds && chunk != SIZE_MAX)
+						bounds->merge(chunk, box);
+					box = empty_box;
+					chunk = piece_chunk;
+				}
+				if (bounds && piece_chunk > 0 && vertex == piece_chunk * CULL_CHUNK_VERTICES) {
+					// the box of the run before covers this vertex too, see ChunkBounds
+					float x = placement.cos_theta * in[0] + placement.sin_theta * in[1] + placement.x;
+					float y = -placement.sin_theta * in[0] + placement.cos_theta * in[1] + placement.y;
+					bounds->merge(piece_chunk - 1, {x, y, x, y});
+				}
+				transform_vertices(in, piece, placement.cos_theta, placement.sin_theta, placement.x, placement.y, out + 2 * vertex, box);
+				in += 2 * piece;
+				vertex += piece;
+				count -= piece;
+			}
+		}
+		if (bounds && chunk != SIZE_MAX)
+			bounds->merge(chunk, box);
+	});
+}
+
+bool compose_lines(const ComposedLines &composed, size_t num_vertices, float *out, ChunkBounds *bounds, const function<bool(size_t)> &progress)
+{
+	// every placement through its transform, in order PROGRESSIVE_CHUNK_VERTICES at a time when
+	// progress is given, which is told how many vertices are final after every one of them and
+	// stops the rest when it returns false, in which case so does this
+	const vector<ComposedLines::Placement> &placements = composed.placements;
+	for (size_t begin = 0; begin < placements.size();) {
+		size_t end = placements.size();
+		if (progress) {
+			end = lower_bound(placements.begin() + begin, placements.end(), placements[begin].first + PROGRESSIVE_CHUNK_VERTICES,
+				[](const ComposedLines::Placement &placement, uint64_t v) { return placement.first < v; }) - placements.begin();
+			end = max(end, begin + 1);
+		}
+		uint64_t end_vertex = end < placements.size() ? placements[end].first : num_vertices;
+		compose_placements(composed, begin, end, placements[begin].first, end_vertex, out, bounds);
+		if (progress && !progress(end_vertex))
+			return false;
+		begin = end;
+	}
+	if (bounds && num_vertices > 0) {
+		// the last placement holds the last vertex
+		const ComposedLines::Placement &last = placements.back();
+		const vector<float> &lines = composed.lines[last.id];
+		float x = lines[lines.size() - 2], y = lines[lines.size() - 1];
+		bounds->last_x = last.cos_theta * x + last.sin_theta * y + last.x;
+		bounds->last_y = -last.sin_theta * x + last.cos_theta * y + last.y;
+	}
+	return true;
+}
+
+// layout of a vertex buffer: components values of a gl type per vertex, taken to the plane by
+// basis (column major mat4x2)
+struct VertexFormat {
+	GLenum type = GL_FLOAT;
+	int components = 2;
+	float basis[8] = {1, 0, 0, 1, 0, 0, 0, 0};
+
+	size_t size() const { return components * (type == GL_SHORT ? sizeof(int16_t) : sizeof(float)); }
+};
+
+// instructions for the lines of a level, resolved and counted before any output is allocated so
+// the output can be sized exactly and written in a single pass by emit_lines
+struct LineSource {
+	const CompiledLsystem *system;
+	size_t level;
+	double forward_distance;
+	// exactly one of these holds the instructions: a level of the history, the module string of
+	// a parametric system, the expansions of a cut level, or none when the level is streamed
+	const string *derivation = nullptr;
+	ModuleString modules;
+	bool composed = false;
+	ComposedLines composition;
+	// line strips instead of separate lines, with their draw ranges
+	bool strips;
+	StripRanges ranges;
+	size_t num_vertices = 0;
+	// integer formats use the lattice
+	VertexFormat format;
+	CyclotomicLattice lattice;
+};
+
+LineSource prepare_lines(DerivationHistory &history, size_t fractal, const CompiledLsystem &system, size_t level, double forward_distance, bool strips, uint64_t budget, const function<bool()> &cancelled = nullptr)
+{
+	// counting pass for a level, the derivation comes from the history when it fits in the budget
+	// and is streamed from its expansion when it doesn't (context free grammars only); the
+	// derivation is cut short once cancelled (optional) returns true, which leaves the source to
+	// be thrown away
+	LineSource source;
+	source.system = &system;
+	source.level = level;
+	source.forward_distance = forward_distance;
+	source.strips = strips;
+	const char *instructions = nullptr;
+	size_t size = 0;
+	if (system.parametric) {
+		source.modules = generate_parametric_lsystem(*system.parametric, level, cancelled);
+		instructions = source.modules.symbols.data();
+		size = source.modules.symbols.size();
+	} else if (COMPOSE_LINES && is_same<TURTLE_COORDINATES, DoubleCoordinates>::value && !EXACT_COORDINATES
+		&& prepare_composition(history, fractal, system, level, forward_distance, strips, source.composition, source.ranges, source.num_vertices, cancelled)) {
+		// float vertices accumulated in double, the same as the turtle writes
+		source.composed = true;
+	} else if (system.is_context_free && predict_generation_footprint(system, level) > budget) {
+		if (strips)
+			source.ranges = strip_ranges_streamed(system, level);
+		else
+			source.num_vertices = 2 * count_forward_streamed(system, level);
+	} else {
+		source.derivation = &history.derivation(fractal, system, level, cancelled);
+		instructions = source.derivation->data();
+		size = source.derivation->size();
+	}
+	if (instructions && strips)
+		source.ranges.add(instructions, size);
+	else if (instructions)
+		source.num_vertices = 2 * count_forward(instructions, size);
+	if (strips)
+		source.num_vertices = source.ranges.num_vertices;
+
+#if EXACT_COORDINATES
+	// no component can grow by more than the largest coefficient per vertex, 16 bits are used
+	// while that fits and 32 bits only with two components, so a vertex never takes more room
+	// than two floats
+	if (!system.parametric && CyclotomicLattice::build(system.angle, forward_distance, source.lattice)) {
+		uint64_t reach = saturating_mul(source.num_vertices, source.lattice.largest_coefficient());
+		GLenum type = reach <= INT16_MAX ? GL_SHORT : source.lattice.rank <= 2 && reach <= INT32_MAX ? GL_INT : GL_FLOAT;
+		if (type != GL_FLOAT) {
+			source.format.type = type;
+			source.format.components = source.lattice.rank;
+			copy(source.lattice.basis, source.lattice.basis + 8, source.format.basis);
+		}
+	}
+#endif
+	return source;
+}
+
+template <typename Coordinates>
+bool emit_lines(const LineSource &source, const Coordinates &coordinates, typename Coordinates::Component *out, ChunkBounds *bounds, const function<bool(size_t)> &progress)
+{
+	if (source.derivation)
+		return generate_lines(*source.derivation, coordinates, out, bounds, source.strips, progress);
+	return generate_lines_streamed(*source.system, source.level, coordinates, out, bounds, source.strips, progress);
+}
+
+bool emit_lines(const LineSource &source, void *out, ChunkBounds *bounds, const function<bool(size_t)> &progress = nullptr)
+{
+	// turtle pass for a prepared level, out must have room for source.num_vertices vertices of
+	// source.format; bounds is optional, and so is progress, which is told how many vertices from
+	// the start are final while composed, streamed and serially turtled levels are written and once
+	// at the end; returning false from it gives up on the rest, and this returns false
+	bool finished = true;
+	if (source.system->parametric)
+		generate_parametric_lines(source.modules, source.system->angle, source.forward_distance, (float *)out, bounds, source.strips);
+	else if (source.composed)
+		finished = compose_lines(source.composition, source.num_vertices, (float *)out, bounds, progress);
+	else if (source.format.type == GL_SHORT)
+		finished = emit_lines(source, CyclotomicCoordinates<int16_t>(source.lattice), (int16_t *)out, bounds, progress);
+	else if (source.format.type == GL_INT)
+		finished = emit_lines(source, CyclotomicCoordinates<int32_t>(source.lattice), (int32_t *)out, bounds, progress);
+	else
+		finished = emit_lines(source, TURTLE_COORDINATES(source.system->angle, source.forward_distance), (float *)out, bounds, progress);
+	return finished && (!progress || progress(source.num_vertices));
+}
+
+// lines of one expansion in the vertex buffer and its transforms in the instance buffer
+struct Subtree {
+	GLint first = 0;
+	GLsizei count = 0;
+	GLuint base_instance = 0;
+	GLsizei instance_count = 0;
+};
+
+struct InstancedSource {
+	const CompiledLsystem *system;
+	double forward_distance;
+	// the cut level, from the history
+	const string *derivation;
+	// indexed by symbol id: the expansion after depth rewrites, where it is drawn from, and the
+	// plane position and turns the turtle ends up at running it from the origin (set by emit_subtrees)
+	vector<string> expansions;
+	vector<Subtree> subtrees;
+	vector<float> end_x;
+	vector<float> end_y;
+	vector<int64_t> turns;
+	size_t num_vertices = 0;
+	size_t num_instances = 0;
+	// vertices of the level as drawn, all instances together
+	uint64_t drawn_vertices = 0;
+};
+
+InstancedSource prepare_instances(DerivationHistory &history, size_t fractal, const CompiledLsystem &system, size_t level, double forward_distance, const function<bool()> &cancelled = nullptr)
+{
+	// counting pass for instanced geometry, the system has to pass can_instance; cancelled works
+	// the same as for prepare_lines
+	InstancedSource source;
+	source.system = &system;
+	source.forward_distance = forward_distance;
+	size_t depth = plan_instancing(system, level).depth;
+	source.derivation = &history.derivation(fractal, system, level - depth, cancelled);
+
+	size_t size = system.alphabet.size() + 1;
+	vector<uint64_t> occurrences(size, 0);
+	for (char c : *source.derivation)
+		occurrences[system.symbol_ids[(unsigned char)c]] += 1;
+	source.expansions = cut_expansions(system, *source.derivation, depth);
+	source.subtrees.resize(size);
+	source.end_x.assign(size, 0);
+	source.end_y.assign(size, 0);
+	source.turns.assign(size, 0);
+	for (size_t id = 0; id + 1 < size; id++) {
+		if (occurrences[id] == 0)
+			continue;
+		Subtree &subtree = source.subtrees[id];
+		subtree.first = source.num_vertices;
+		subtree.count = 2 * count_forward(source.expansions[id].data(), source.expansions[id].size());
+		source.num_vertices += subtree.count;
+		if (subtree.count > 0) {
+			subtree.base_instance = source.num_instances;
+			subtree.instance_count = occurrences[id];
+			source.num_instances += occurrences[id];
+			source.drawn_vertices += occurrences[id] * subtree.count;
+		}
+	}
+	return source;
+}
+
+void emit_subtrees(InstancedSource &source, float *out)
+{
+	// lines of every expansion from the origin facing heading 0, out must have room for
+	// source.num_vertices vertices of two floats
+	// brackets are left to emit_instances
+	TURTLE_COORDINATES coordinates(source.system->angle, source.forward_distance);
+	for (size_t id = 0; id < source.expansions.size(); id++) {
+		if (source.expansions[id] == "[" || source.expansions[id] == "]")
+			continue;
+		Subtree &subtree = source.subtrees[id];
+		HeadingTurtle<TURTLE_COORDINATES> turtle(coordinates, out + 2 * subtree.first);
+		for (char c : source.expansions[id])
+			turtle.run(c);
+		coordinates.plane(turtle.position, source.end_x[id], source.end_y[id]);
+		source.turns[id] = turtle.heading;
+	}
+}
+
+void emit_instances(const InstancedSource &source, float *out)
+{
+	// walk the cut level carrying the turtle from expansion to expansion and write the transform of
+	// every occurrence that draws anything as x, y, heading angle and the number of vertices drawn
+	// before it less the start of its lines (for the gradient); out must have room for
+	// source.num_instances of them
+	const CompiledLsystem &system = *source.system;
+	TURTLE_COORDINATES coordinates(system.angle, source.forward_distance);
+	int64_t period = heading_period(system.angle);
+	vector<GLuint> next_instance(source.subtrees.size());
+	for (size_t id = 0; id < source.subtrees.size(); id++)
+		next_instance[id] = source.subtrees[id].base_instance;
+
+	struct State {
+		double x, y;
+		int64_t heading;
+	};
+	State state = {0, 0, 0};
+	vector<State> saved_state;
+	uint64_t drawn = 0;
+	for (char c : *source.derivation) {
+		if (c == '[') {
+			saved_state.push_back(state);
+			continue;
+		}
+		if (c == ']') {
+			state = saved_state.back();
+			saved_state.pop_back();
+			continue;
+		}
+		size_t id = system.symbol_ids[(unsigned char)c];
+		const Subtree &subtree = source.subtrees[id];
+		if (subtree.count == 0 && source.end_x[id] == 0 && source.end_y[id] == 0) {
+			state.heading = coordinates.turn(state.heading, source.turns[id]);
+			continue;
+		}
+		double theta = period > 0 ? (state.heading % period) * system.angle : state.heading * system.angle;
+		double cos_theta = cos(theta);
+		double sin_theta = sin(theta);
+		if (subtree.count > 0) {
+			float *instance = out + 4 * next_instance[id]++;
+			instance[0] = state.x;
+			instance[1] = state.y;
+			instance[2] = fmod(theta, 2 * M_PI);
+			instance[3] = (double)drawn - subtree.first;
+			drawn += subtree.count;
+		}
+		// rotating the heading by theta rotates plane coordinates clockwise, see DoubleCoordinates
+		state.x += cos_theta * source.end_x[id] + sin_theta * source.end_y[id];
+		state.y += -sin_theta * source.end_x[id] + cos_theta * source.end_y[id];
+		state.heading = coordinates.turn(state.heading, source.turns[id]);
+	}
+}
+
+struct ScreenTransform {
+	// where main.vert puts plane coordinates on screen, as the affine map
+	// ndc = (xx * x + xy * y + x0, yx * x + yy * y + y0); depth clipping is left out, which only
+	// makes culling more conservative
+	float xx, xy, x0;
+	float yx, yy, y0;
+
+	ScreenTransform(float offset_x, float offset_y, float angle, float zoom)
+	{
+		// rotZ then rotX by 0.3 angle, the offset, then the orthographic transform with w = 1 / zoom
+		float c = cos(angle * 0.3);
+		float s = sin(angle * 0.3);
+		xx = c * zoom / WIDTH;
+		xy = s * zoom / WIDTH;
+		x0 = offset_x * zoom / WIDTH;
+		yx = -c * s * zoom / HEIGHT;
+		yy = c * c * zoom / HEIGHT;
+		y0 = offset_y * zoom / HEIGHT;
+	}
+
+	ScreenTransform transformed(const array<float, 4> &linear, const array<float, 2> &translation) const
+	{
+		// same transform for plane coordinates that go through linear (column major 2x2) and
+		// translation first
+		ScreenTransform screen = *this;
+		screen.xx = xx * linear[0] + xy * linear[1];
+		screen.xy = xx * linear[2] + xy * linear[3];
+		screen.x0 = xx * translation[0] + xy * translation[1] + x0;
+		screen.yx = yx * linear[0] + yy * linear[1];
+		screen.yy = yx * linear[2] + yy * linear[3];
+		screen.y0 = yx * translation[0] + yy * translation[1] + y0;
+		return screen;
+	}
+
+	enum Visibility { OUTSIDE, PARTIAL, INSIDE };
+
+	Visibility classify(const Box &box) const
+	{
+		if (box[0] > box[2])
+			return OUTSIDE;
+		float center_x = (box[0] + box[2]) / 2, center_y = (box[1] + box[3]) / 2;
+		float half_x = (box[2] - box[0]) / 2, half_y = (box[3] - box[1]) / 2;
+		float x = xx * center_x + xy * center_y + x0;
+		float y = yx * center_x + yy * center_y + y0;
+		float extent_x = fabs(xx) * half_x + fabs(xy) * half_y;
+		float extent_y = fabs(yx) * half_x + fabs(yy) * half_y;
+		if (x - extent_x > 1 || x + extent_x < -1 || y - extent_y > 1 || y + extent_y < -1)
+			return OUTSIDE;
+		if (x - extent_x >= -1 && x + extent_x <= 1 && y - extent_y >= -1 && y + extent_y <= 1)
+			return INSIDE;
+		return PARTIAL;
+	}
+};
+
+class SpatialIndex {
+	// bounding volume hierarchy over the ChunkBounds boxes of a vertex buffer: the turtle walks the
+	// curve in order so consecutive runs of vertices are close in space, and a complete binary tree
+	// over them in buffer order makes a good hierarchy without any sorting; a query costs time in
+	// the number of visible runs rather than the total
+	vector<Box> nodes;
+	size_t leaves = 0;
+	size_t num_chunks = 0;
+
+	void visible(const ScreenTransform &screen, size_t node, size_t begin, size_t end, vector<pair<size_t, size_t>> &ranges) const
+	{
+		if (begin >= num_chunks)
+			return;
+		ScreenTransform::Visibility visibility = screen.classify(nodes[node]);
+		if (visibility == ScreenTransform::OUTSIDE)
+			return;
+		if (visibility == ScreenTransform::INSIDE || end - begin == 1) {
+			end = min(end, num_chunks);
+			if (!ranges.empty() && ranges.back().second == begin)
+				ranges.back().second = end;
+			else
+				ranges.push_back({begin, end});
+			return;
+		}
+		size_t middle = (begin + end) / 2;
+		visible(screen, 2 * node, begin, middle, ranges);
+		visible(screen, 2 * node + 1, middle, end, ranges);
+	}
+
+public:
+	void build(const vector<Box> &boxes)
+	{
+		// heap layout, node i has children 2i and 2i + 1 and the leaves start at index leaves
+		num_chunks = boxes.size();
+		for (leaves = 1; leaves < num_chunks; leaves *= 2);
+		nodes.assign(2 * leaves, empty_box);
+		copy(boxes.begin(), boxes.end(), nodes.begin() + leaves);
+		for (size_t node = leaves - 1; node > 0; node--) {
+			nodes[node] = nodes[2 * node];
+			extend_box(nodes[node], nodes[2 * node + 1]);
+		}
+	}
+
+	Box bounds() const { return nodes.empty() ? empty_box : nodes[1]; }
+
+	void visible(const ScreenTransform &screen, vector<pair<size_t, size_t>> &ranges) const
+	{
+		// runs [first, second) of chunks that may be on screen, in order
+		ranges.clear();
+		if (num_chunks > 0)
+			visible(screen, 1, 0, leaves, ranges);
+	}
+};
+
+// everything that determines the geometry of a fractal
+struct GeometryKey {
+	uint64_t grammar_hash;
+	size_t num_iterations;
+	double angle;
+	double forward_distance;
+	bool strips;
+	bool instanced;
+
+	bool operator<(const GeometryKey &other) const
+	{
+		return tie(grammar_hash, num_iterations, angle, forward_distance, strips, instanced)
+			< tie(other.grammar_hash, other.num_iterations, other.angle, other.forward_distance, other.strips, other.instanced);
+	}
+};
+
+// gpu buffer handed out by BufferPool, size is its capacity which may be more than was asked for;
+// it stays mapped at mapped for its whole life, and any thread may write through that
+struct GpuBuffer {
+	unsigned int name = 0;
+	uint64_t size = 0;
+	void *mapped = nullptr;
+};
+
+class BufferPool {
+	// immutable buffers (glBufferStorage) in size classes, kept after release for the next request
+	// of the same class instead of being deleted and created again on every regeneration; draws
+	// already queued may still read a released buffer, so it is fenced and only handed out again
+	// once the fence has signaled. live bytes are the ones handed out, idle buffers are deleted
+	// oldest first to keep live and idle bytes within the budget. the buffers are persistently
+	// and coherently mapped, so the generation worker writes vertices straight into them while
+	// the gl thread draws; the fences are what keeps it off a buffer the gpu still reads
+	struct Idle {
+		GpuBuffer buffer;
+		GLsync fence;
+	};
+	deque<Idle> idle;
+	uint64_t budget;
+	uint64_t live = 0;
+	uint64_t idle_bytes = 0;
+
+	static uint64_t size_class(uint64_t size)
+	{
+		// at most a quarter over the size asked for
+		if (size <= MIN_POOLED_BUFFER_BYTES)
+			return MIN_POOLED_BUFFER_BYTES;
+		int bits = 63 - __builtin_clzll(size - 1);
+		uint64_t step = (uint64_t)1 << (bits - 2);
+		return (size + step - 1) & ~(step - 1);
+	}
+
+	void drop(deque<Idle>::iterator it)
+	{
+		glDeleteSync(it->fence);
+		glDeleteBuffers(1, &it->buffer.name);
+		idle_bytes -= it->buffer.size;
+		idle.erase(it);
+	}
+
+	void trim(uint64_t incoming)
+	{
+		// deleting a buffer the gpu still reads is deferred by gl, no need to wait for the fence
+		while (!idle.empty() && live + idle_bytes + incoming > budget)
+			drop(idle.begin());
+	}
+
+public:
+	size_t allocated = 0;
+	size_t reused = 0;
+
+	BufferPool(uint64_t budget) : budget(budget) {}
+
+	GpuBuffer acquire(uint64_t size)
+	{
+		// a buffer of at least size bytes, left bound to GL_ARRAY_BUFFER; its contents are undefined
+		uint64_t capacity = size_class(size);
+		GpuBuffer buffer;
+		for (auto it = idle.begin(); it != idle.end(); ++it) {
+			if (it->buffer.size != capacity)
+				continue;
+			GLenum status = glClientWaitSync(it->fence, 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+				continue;
+			buffer = it->buffer;
+			glDeleteSync(it->fence);
+			idle_bytes -= buffer.size;
+			idle.erase(it);
+			reused++;
+			glBindBuffer(GL_ARRAY_BUFFER, buffer.name);
+			live += buffer.size;
+			return buffer;
+		}
+		trim(capacity);
+		glGenBuffers(1, &buffer.name);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer.name);
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, capacity, nullptr, flags);
+		buffer.mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, capacity, flags);
+		if (!buffer.mapped) {
+			cerr << "failed to map a buffer of " << capacity << " bytes" << endl;
+			exit(1);
+		}
+		buffer.size = capacity;
+		allocated++;
+		live += buffer.size;
+		return buffer;
+	}
+
+	void release(GpuBuffer &buffer)
+	{
+		// back into the pool once the draws queued so far are done with it
+		if (!buffer.name)
+			return;
+		live -= buffer.size;
+		idle.push_back({buffer, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)});
+		idle_bytes += buffer.size;
+		buffer = GpuBuffer();
+		trim(0);
+	}
+
+	uint64_t live_bytes() const { return live; }
+
+	bool over_budget() const { return live > budget; }
+
+	void clear()
+	{
+		// gl objects have to go before the context does, buffers still handed out are the owners' to release
+		while (!idle.empty())
+			drop(idle.begin());
+	}
+};
+
+struct CachedGeometry {
+	// uploaded lines, there is no cpu side copy; the buffers belong to a BufferPool
+	unsigned int vao = 0;
+	GpuBuffer vertex_buffer;
+	size_t num_vertices = 0;
+	VertexFormat format;
+	// draw ranges when the lines are line strips
+	bool strips = false;
+	vector<GLint> first;
+	vector<GLsizei> count;
+	// bounding boxes for culling
+	SpatialIndex index;
+	// where the turtle ends up, see ChunkBounds
+	float end_x = 0;
+	float end_y = 0;
+	// instanced geometry: the vertices are the lines of the subtrees, drawn at the transforms in
+	// instance_buffer, and nothing is culled
+	GpuBuffer instance_buffer;
+	size_t num_instances = 0;
+	vector<Subtree> subtrees;
+	uint64_t drawn_vertices = 0;
+
+	bool instanced() const { return instance_buffer.name != 0; }
+};
+
+void bind_lines(CachedGeometry &geometry)
+{
+	// vertex array reading geometry.vertex_buffer, both left bound
+	glGenVertexArrays(1, &geometry.vao);
+	glBindVertexArray(geometry.vao);
 
-using namespace std;
+	glBindBuffer(GL_ARRAY_BUFFER, geometry.vertex_buffer.name);
+	glVertexAttribPointer(0, geometry.format.components, geometry.format.type, GL_FALSE, geometry.format.size(), (void*)0);
+	glEnableVertexAttribArray(0);
+}
 
-#define WIDTH 1920
-#define HEIGHT 1080
-// #define WIDTH 3440
-// #define HEIGHT 1440
+void upload_lines(CachedGeometry &geometry, BufferPool &pool, const function<void(void *)> &emit_instances)
+{
+	// set up drawing lines whose vertices are already in geometry.vertex_buffer; with
+	// geometry.num_instances set emit_instances writes the transforms into a second buffer read
+	// once per instance
+	bind_lines(geometry);
 
-#define ANGLE_DELTA M_PI / (6 * 2)
-#define FORWARD_DELTA 100
-#define ZOOM_FACTOR 1.1
+	if (geometry.num_instances > 0) {
+		geometry.instance_buffer = pool.acquire(geometry.num_instances * 4 * sizeof(float));
+		emit_instances(geometry.instance_buffer.mapped);
+		glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+		glVertexAttribDivisor(1, 1);
+		glEnableVertexAttribArray(1);
+	}
 
-struct Lsystem {
-    // grammar alphabet subset that does not have production rules
-    vector<string> constants;
-    // starting string
-    string axiom;
-    // replacement lookup map
-    map<string, string> rules;
-    // angle magnitude for "+" and "-"
-    double angle;
-	bool is_context_free;
-};
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+}
 
-void print_string(string out, size_t start)
+void release_lines(CachedGeometry &geometry, BufferPool &pool)
 {
-	for(int i = start; i < out.size(); ++i) {
-		cout << out[i];
+	pool.release(geometry.vertex_buffer);
+	pool.release(geometry.instance_buffer);
+	glDeleteVertexArrays(1, &geometry.vao);
+	geometry.vao = 0;
+}
+
+void draw_lines(const CachedGeometry &geometry, const ScreenTransform &screen)
+{
+	// draw the runs of vertices the spatial index can't rule out, cut down to the strips running
+	// through them when the lines are line strips
+	vector<pair<size_t, size_t>> chunks;
+	geometry.index.visible(screen, chunks);
+	vector<GLint> first;
+	vector<GLsizei> count;
+	for (const auto &chunk : chunks) {
+		size_t begin = chunk.first * CULL_CHUNK_VERTICES;
+		size_t end = min(geometry.num_vertices, chunk.second * CULL_CHUNK_VERTICES);
+		if (!geometry.strips) {
+			first.push_back(begin);
+			count.push_back(end - begin);
+			continue;
+		}
+		// the last vertex of a run is drawn along so the strip segment leaving it isn't lost
+		end = min(geometry.num_vertices, end + 1);
+		size_t strip = upper_bound(geometry.first.begin(), geometry.first.end(), (GLint)begin) - geometry.first.begin();
+		for (strip = strip > 0 ? strip - 1 : 0; strip < geometry.first.size() && (size_t)geometry.first[strip] < end; strip++) {
+			size_t strip_begin = max<size_t>(geometry.first[strip], begin);
+			size_t strip_end = min<size_t>(geometry.first[strip] + geometry.count[strip], end);
+			if (strip_end >= strip_begin + 2) {
+				first.push_back(strip_begin);
+				count.push_back(strip_end - strip_begin);
+			}
+		}
 	}
-	cout << endl;
+
+	glBindVertexArray(geometry.vao);
+	glMultiDrawArrays(geometry.strips ? GL_LINE_STRIP : GL_LINES, first.data(), count.data(), first.size());
+	glBindVertexArray(0);
 }
 
-template<typename T>
-void print_vector(vector<T> out, size_t start, size_t end = 0)
+void draw_prefix(const CachedGeometry &geometry, size_t num_vertices)
 {
-	int i = 0;
-	for(i = start; i < max(out.size(), end) -1; ++i) {
-		cout << out[i] << ", ";
+	// draw the first num_vertices vertices of lines still being uploaded, unculled since the spatial
+	// index only comes with the whole level
+	glBindVertexArray(geometry.vao);
+	if (!geometry.strips) {
+		glDrawArrays(GL_LINES, 0, num_vertices & ~(size_t)1);
+	} else {
+		size_t strips = lower_bound(geometry.first.begin(), geometry.first.end(), (GLint)num_vertices) - geometry.first.begin();
+		vector<GLsizei> count(geometry.count.begin(), geometry.count.begin() + strips);
+		if (strips > 0)
+			count.back() = min<size_t>(count.back(), num_vertices - geometry.first[strips - 1]);
+		glMultiDrawArrays(GL_LINE_STRIP, geometry.first.data(), count.data(), strips);
 	}
-	cout << out[i] << endl;
+	glBindVertexArray(0);
 }
 
-void start_window_renderer_and_gl(SDL_Window **window, SDL_Renderer **renderer, SDL_GLContext *gl_context, size_t width, size_t height)
+void draw_instances(const CachedGeometry &geometry)
 {
-	// create the window, renderer and gl context
-	if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-		std::cerr << "SDL2 video subsystem couldn't be initialized. Error: " << SDL_GetError() << std::endl;
-		exit(1);
+	// one instanced draw per subtree, its transforms are a contiguous run of the instance buffer
+	glBindVertexArray(geometry.vao);
+	for (const Subtree &subtree : geometry.subtrees) {
+		if (subtree.instance_count > 0)
+			glDrawArraysInstancedBaseInstance(GL_LINES, subtree.first, subtree.count, subtree.instance_count, subtree.base_instance);
 	}
+	glBindVertexArray(0);
+}
 
-	// window
-    SDL_WindowFlags window_flags = (SDL_WindowFlags)(SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI);
-	*window = SDL_CreateWindow(
-		"L-Systems Explorer",
-		SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-		WIDTH, HEIGHT, window_flags
-	);
+class GeometryCache {
+	// gl buffers of generated lines, evicted least recently used first while the buffers handed
+	// out by the pool are over its budget; the most recently used entry is never evicted since it
+	// is on screen
+	typedef list<pair<GeometryKey, CachedGeometry>> Entries;
+	Entries entries;
+	map<GeometryKey, Entries::iterator> index;
+	BufferPool &pool;
 
-	// renderer
-	*renderer = SDL_CreateRenderer(*window, -1, SDL_RENDERER_ACCELERATED);
-	if (*renderer == nullptr) {
-		std::cerr << "SDL2 Renderer couldn't be created. Error: "
-				<< SDL_GetError()
-				<< std::endl;
-		exit(1);
+	void evict()
+	{
+		while (pool.over_budget() && entries.size() > 1) {
+			CachedGeometry &geometry = entries.back().second;
+			release_lines(geometry, pool);
+			index.erase(entries.back().first);
+			entries.pop_back();
+		}
 	}
 
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 6);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
-    // SDL_GL_SetSwapInterval(0); // 1 -> vsync : 0 -> NO vsync 
-	SDL_GL_SetAttribute(SDL_GL_RED_SIZE, 8);
-	SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 8);
-	SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 8);
-	SDL_GL_SetAttribute(SDL_GL_ALPHA_SIZE, 8);
-    SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
-	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+public:
+	size_t hits = 0;
+	size_t misses = 0;
 
-	// create GL context
-	*gl_context = SDL_GL_CreateContext(*window);
-	// Load GL extensions using glad
-	if (!gladLoadGLLoader((GLADloadproc) SDL_GL_GetProcAddress)) {
-		std::cerr << "Failed to initialize the OpenGL context." << std::endl;
-		exit(1);
+	GeometryCache(BufferPool &pool) : pool(pool) {}
+
+	CachedGeometry *find(const GeometryKey &key)
+	{
+		// look up and mark as most recently used
+		auto found = index.find(key);
+		if (found == index.end()) {
+			misses++;
+			return nullptr;
+		}
+		hits++;
+		entries.splice(entries.begin(), entries, found->second);
+		return &entries.front().second;
 	}
-	// std::cout << "OpenGL version loaded: " << GLVersion.major << "." << GLVersion.minor << std::endl;
-}
 
-unsigned int compile_shader(unsigned int shader_type, const std::string& shader_source)
-{
-	unsigned int shader_id = glCreateShader(shader_type);
+	CachedGeometry &insert(const GeometryKey &key, CachedGeometry lines, const function<void(void *)> &emit_instances = nullptr)
+	{
+		// take lines whose vertices are already in lines.vertex_buffer (and lines.num_instances
+		// transforms written by emit_instances) as the most recently used entry
+		upload_lines(lines, pool, emit_instances);
+		return adopt(key, move(lines));
+	}
 
-	const char* c_source = shader_source.c_str();
-	glShaderSource(shader_id, 1, &c_source, nullptr);
-	glCompileShader(shader_id);
+	CachedGeometry &adopt(const GeometryKey &key, CachedGeometry geometry)
+	{
+		// take over lines that are already uploaded as the most recently used entry
+		entries.emplace_front(key, move(geometry));
+		index[key] = entries.begin();
+		evict();
+		return entries.front().second;
+	}
 
-	GLint result;
-	glGetShaderiv(shader_id, GL_COMPILE_STATUS, &result);
+	vector<GeometryKey> keys() const
+	{
+		vector<GeometryKey> out;
+		for (const auto &entry : entries)
+			out.push_back(entry.first);
+		return out;
+	}
 
-	if (result == GL_FALSE) {
-		int length;
-		glGetShaderiv(shader_id, GL_INFO_LOG_LENGTH, &length);
+	void clear()
+	{
+		// gl objects have to go before the context does, so this isn't left to the destructor
+		for (auto &entry : entries)
+			release_lines(entry.second, pool);
+		entries.clear();
+		index.clear();
+	}
+};
 
-		GLchar* strInfoLog = new GLchar[length + 1];
-		glGetShaderInfoLog(shader_id, length, &length, strInfoLog);
+GeometryKey geometry_key(const CompiledLsystem &system, size_t level, double forward_distance, bool strips, bool instanced)
+{
+	// instanced geometry is always separate lines
+	return {system.hash, level, system.angle, forward_distance, strips && !instanced, instanced};
+}
 
-		fprintf(stderr, "Compilation error in shader: %s\n", strInfoLog);
-		delete[] strInfoLog;
-	}
+// a level generated away from the gl thread: the geometry without its vertex array, its vertices
+// already in lines.vertex_buffer, and the instance transforms waiting to be uploaded
+struct GeneratedLevel {
+	// the request it was generated for, see GenerationWorker
+	uint64_t id = 0;
+	GeometryKey key;
+	CachedGeometry lines;
+	vector<float> instances;
+	// vertices from the start that are final, the rest of the buffer is still being written while
+	// this is short of lines.num_vertices
+	atomic<size_t> done{0};
+};
 
-	return shader_id;
+bool generate_level(DerivationHistory &history, size_t fractal, const CompiledLsystem &system, size_t level, double forward_distance, bool strips, bool instanced, uint64_t budget, const function<bool()> &cancelled, const function<GpuBuffer(uint64_t)> &allocate, GeneratedLevel &out, const function<void()> &grown = nullptr)
+{
+	// lines of a level straight into a mapped gpu buffer from allocate, instanced only when the
+	// system passes can_instance; gives up as soon as cancelled returns true (it is checked every
+	// rewrite step and every PROGRESSIVE_CHUNK_VERTICES of the turtle pass where the turtle runs in
+	// order) or allocate comes back without a buffer; grown is optional and called every time
+	// out.done moves, once the vertex counts, draw ranges and buffer are final
+	out.key = geometry_key(system, level, forward_distance, strips, instanced);
+	CachedGeometry &lines = out.lines;
+	if (instanced) {
+		InstancedSource source = prepare_instances(history, fractal, system, level, forward_distance, cancelled);
+		if (cancelled())
+			return false;
+		lines.num_vertices = source.num_vertices;
+		lines.num_instances = source.num_instances;
+		lines.subtrees = source.subtrees;
+		lines.drawn_vertices = source.drawn_vertices;
+		lines.vertex_buffer = allocate(source.num_vertices * lines.format.size());
+		if (!lines.vertex_buffer.name || cancelled())
+			return false;
+		out.instances.resize(4 * source.num_instances);
+		emit_subtrees(source, (float *)lines.vertex_buffer.mapped);
+		emit_instances(source, out.instances.data());
+		out.done = source.num_vertices;
+		return true;
+	}
+	LineSource source = prepare_lines(history, fractal, system, level, forward_distance, strips, budget, cancelled);
+	if (cancelled())
+		return false;
+	lines.num_vertices = source.num_vertices;
+	lines.drawn_vertices = source.num_vertices;
+	lines.format = source.format;
+	lines.strips = source.strips;
+	lines.first.swap(source.ranges.first);
+	lines.count.swap(source.ranges.count);
+	lines.vertex_buffer = allocate(source.num_vertices * source.format.size());
+	if (!lines.vertex_buffer.name || cancelled())
+		return false;
+	ChunkBounds bounds(source.num_vertices);
+	bool finished = emit_lines(source, lines.vertex_buffer.mapped, &bounds, [&](size_t done) {
+		if (cancelled())
+			return false;
+		out.done.store(done, memory_order_release);
+		if (grown)
+			grown();
+		return true;
+	});
+	if (!finished)
+		return false;
+	lines.index.build(bounds.boxes);
+	lines.end_x = bounds.last_x;
+	lines.end_y = bounds.last_y;
+	return true;
 }
 
-unsigned int load_shaders(const std::string& vertexShaderFile, const std::string& fragmentShaderFile)
+CachedGeometry &upload_level(GeometryCache &cache, GeneratedLevel &level)
 {
-	std::ifstream is_vs(vertexShaderFile);
-	const std::string f_vs((std::istreambuf_iterator<char>(is_vs)), std::istreambuf_iterator<char>());
+	// on the gl thread, makes a new cache entry of the vertex buffer and uploads the transforms;
+	// the level no longer owns the buffer after this
+	CachedGeometry lines = move(level.lines);
+	level.lines = CachedGeometry();
+	return cache.insert(level.key, move(lines),
+		[&](void *out) { memcpy(out, level.instances.data(), level.instances.size() * sizeof(float)); });
+}
 
-	std::ifstream is_fs(fragmentShaderFile);
-	const std::string f_fs((std::istreambuf_iterator<char>(is_fs)), std::istreambuf_iterator<char>());
+class GrowingGeometry {
+	// the current level while the worker is still writing it: a vertex array over the buffer the
+	// worker writes into, of which whatever the worker has finished is drawn; the buffer stays the
+	// level's until it is done and goes over to the cache
+	shared_ptr<GeneratedLevel> level;
+	CachedGeometry geometry;
+	size_t ready = 0;
 
-	unsigned int id = glCreateProgram();
+public:
+	bool active(uint64_t id) const { return level && level->id == id && ready > 0; }
 
-	unsigned int vs = compile_shader(GL_VERTEX_SHADER, f_vs);
-	unsigned int fs = compile_shader(GL_FRAGMENT_SHADER, f_fs);
+	CachedGeometry &lines() { return geometry; }
 
-	glAttachShader(id, vs);
-	glAttachShader(id, fs);
+	size_t size() const { return ready; }
 
-	glLinkProgram(id);
-	glValidateProgram(id);
+	bool update(const shared_ptr<GeneratedLevel> &latest, uint64_t id)
+	{
+		// follow the level the worker is growing for request id, returns whether it has finished
+		// anything new to draw since the last call; a level that isn't shared anymore is either
+		// done or given up on, and one without a buffer already went to the cache
+		if (level && (level->id != id || latest != level))
+			release();
+		if (!level && latest && latest->id == id && latest->lines.vertex_buffer.name) {
+			// only the fields that are final before the first vertex is written, see generate_level
+			level = latest;
+			geometry.num_vertices = level->lines.num_vertices;
+			geometry.drawn_vertices = level->lines.drawn_vertices;
+			geometry.format = level->lines.format;
+			geometry.strips = level->lines.strips;
+			geometry.first = level->lines.first;
+			geometry.count = level->lines.count;
+			geometry.vertex_buffer = level->lines.vertex_buffer;
+			bind_lines(geometry);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			glBindVertexArray(0);
+		}
+		if (!level)
+			return false;
+		// the mapping is coherent, so what the worker wrote before done is seen by draws issued after
+		size_t done = level->done.load(memory_order_acquire);
+		if (done == ready)
+			return false;
+		ready = done;
+		return true;
+	}
 
-	glDeleteShader(vs);
-	glDeleteShader(fs);
+	bool finish(GeometryCache &cache, const shared_ptr<GeneratedLevel> &generated)
+	{
+		// hand the vertex array and the buffer to the cache when generated is the level being
+		// grown, with its bounding boxes; false leaves generated to upload_level
+		if (!level || level != generated)
+			return false;
+		geometry.index = move(level->lines.index);
+		geometry.end_x = level->lines.end_x;
+		geometry.end_y = level->lines.end_y;
+		level->lines.vertex_buffer = GpuBuffer();
+		cache.adopt(level->key, move(geometry));
+		geometry = CachedGeometry();
+		level.reset();
+		ready = 0;
+		return true;
+	}
 
-	return id;
-}
+	void release()
+	{
+		// the buffer goes back with the level, see GenerationWorker
+		if (level)
+			glDeleteVertexArrays(1, &geometry.vao);
+		geometry = CachedGeometry();
+		level.reset();
+		ready = 0;
+	}
+};
 
-string run_step_context_free(Lsystem system, string step)
+// lower iteration level drawn in place of the current one while the detail the levels in between
+// add is too small to see
+struct LodLevel {
+	CachedGeometry *geometry;
+	// similarity taking the level onto the current one, column major 2x2 then translation
+	array<float, 4> similarity;
+	array<float, 2> translation;
+	// length of its segments relative to the current level's
+	double scale;
+
+	void offset(float angle, float &offset_x, float &offset_y) const
+	{
+		// main.vert adds the offset after rotating, so the translation goes in rotated the same way
+		float c = cos(angle * 0.3);
+		float s = sin(angle * 0.3);
+		offset_x += c * translation[0] + s * translation[1];
+		offset_y += c * (-s * translation[0] + c * translation[1]);
+	}
+};
+
+bool has_branches(const CompiledLsystem &system)
 {
-    // run single grammar generation step
-    string out;
-    for (size_t i = 0; i < step.size(); i++) {
-        string current = string(1, step[i]);
-        if (find(system.constants.begin(), system.constants.end(), current) != system.constants.end())
-            out.append(current);
-        else
-            out.append(system.rules[current]);
-    }
-    return out;
+	// whether a derivation can contain '[', constants only ever rewrite to themselves
+	auto branches = [&](uint32_t offset, uint32_t length) {
+		return memchr(system.replacement_pool.data() + offset, '[', length) != nullptr;
+	};
+	if (system.parametric || system.axiom.find('[') != string::npos)
+		return true;
+	for (const Production &production : system.productions) {
+		if (!production.is_constant && branches(production.offset, production.length))
+			return true;
+	}
+	for (const Production &alternative : system.alternatives) {
+		if (branches(alternative.offset, alternative.length))
+			return true;
+	}
+	for (const CompiledContextRule &rule : system.context_rules) {
+		if (branches(rule.offset, rule.length))
+			return true;
+	}
+	return false;
 }
 
-// string generate_lsystem(string axiom, map<string, string> rules, vector<string> constants, size_t num_iterations) {
-string generate_lsystem(Lsystem system, size_t num_iterations)
+LodLevel align_level(CachedGeometry *level, const CachedGeometry &target, bool branches)
 {
-    // helper for running the desired number of iterations of an L-system given the starting axiom
-    string next_step = system.axiom;
-    for (size_t i = 0; i < num_iterations; i++) {
-		next_step = run_step_context_free(system, next_step);
-    }
-    return next_step;
+	// every level starts at the origin, so on curves without branches the end points fix the
+	// rotation and scale taking one level onto the other (the dragon turns by 45 degrees a level);
+	// with branches, or on closed curves, the bounding box of the level is scaled and moved onto
+	// the current one's
+	Box level_box = level->index.bounds();
+	Box target_box = target.index.bounds();
+	double level_size = hypot(level_box[2] - level_box[0], level_box[3] - level_box[1]);
+	double target_size = hypot(target_box[2] - target_box[0], target_box[3] - target_box[1]);
+	double level_end = hypot(level->end_x, level->end_y);
+	if (!branches && level_end > 1e-3 * level_size && hypot(target.end_x, target.end_y) > 1e-3 * target_size) {
+		// target end / level end as complex numbers
+		double real = (target.end_x * level->end_x + target.end_y * level->end_y) / (level_end * level_end);
+		double imaginary = (target.end_y * level->end_x - target.end_x * level->end_y) / (level_end * level_end);
+		return {level, {(float)real, (float)imaginary, (float)-imaginary, (float)real}, {0, 0}, hypot(real, imaginary)};
+	}
+	double scale = level_size > 0 ? target_size / level_size : 1;
+	float translation_x = (target_box[0] + target_box[2]) / 2 - scale * (level_box[0] + level_box[2]) / 2;
+	float translation_y = (target_box[1] + target_box[3]) / 2 - scale * (level_box[1] + level_box[3]) / 2;
+	return {level, {(float)scale, 0, 0, (float)scale}, {translation_x, translation_y}, scale};
 }
 
-vector<float> generate_lines(string instructions, double angle_delta, double forward_distance)
+size_t choose_lod_level(const vector<LodLevel> &levels, double forward_distance, float zoom)
 {
-    // run thrugh the insturction string one character at a time and run the character as an insturction
-    // returns a flat array of lines serialized in order x1, y1, x2, y2
-    vector<float> out_buffer;
-    double x = 0;
-    double y = 0;
-	double angle = 0;
+	// levels go from the current one down; the lowest one whose segments are at most
+	// LOD_SEGMENT_PIXELS long on screen is drawn, what the levels above it add is finer than that
+	// (the orthographic transform spans twice the window size, so a unit is zoom / 2 pixels)
+	for (size_t i = levels.size(); i-- > 1;) {
+		if (levels[i].scale * forward_distance * zoom / 2 <= LOD_SEGMENT_PIXELS)
+			return i;
+	}
+	return 0;
+}
 
-    stack<tuple<double, double, double>> saved_position;
-    for (size_t i = 0; i < instructions.size(); i++) {
-        switch(instructions[i]) {
-            // move forward
-            case 'F': {
-                // extend (x, y) with (0, forward_distance) and rotate to by the angle
-                double new_x = x + forward_distance*sin(angle);
-                double new_y = y - forward_distance*cos(angle);
+class GenerationWorker {
+	// generates geometry on a thread of its own so the window keeps drawing the previous geometry
+	// meanwhile; requests coalesce, the worker only ever picks up the latest one and gives up on a
+	// job between levels (and between the passes of a level) as soon as a newer one comes in; the
+	// result goes back through a single slot exchanged atomically, and an SDL event wakes the
+	// render loop up to take it; the current level is generated first and shared while it grows,
+	// with an event every PROGRESSIVE_CHUNK_VERTICES, so it can be drawn before it is done. levels
+	// are written straight into mapped buffers of the pool, which only the gl thread can hand out,
+	// so the worker asks for one and waits for serve; the buffers of levels that are dropped
+	// without being drawn go back the same way
+public:
+	struct Request {
+		const CompiledLsystem *system;
+		size_t fractal;
+		size_t num_iterations;
+		double forward_distance;
+		bool strips;
+		bool instancing;
+		bool level_of_detail;
+		uint64_t budget;
+		// levels the gl thread already has, they are not generated again
+		vector<GeometryKey> cached;
+	};
 
-                out_buffer.push_back(+x);
-                out_buffer.push_back(-y);
-                out_buffer.push_back(+new_x);
-                out_buffer.push_back(-new_y);
+	struct Result {
+		uint64_t id;
+		// the level after admission, and the lowest level kept for level of detail
+		size_t num_iterations;
+		size_t lowest;
+		bool instanced;
+		// from the lowest level up, only the ones that weren't cached
+		vector<shared_ptr<GeneratedLevel>> levels;
+	};
 
-                y = new_y;
-                x = new_x;
-                break;
-            }
-            // update angle
-            case '-':
-                angle = fmod(angle - angle_delta, 2*M_PI);
-                break;
-            case '+':
-                angle = fmod(angle + angle_delta, 2*M_PI);
-                break;
-            // push/pop position and angle stack
-            case '[':
-                saved_position.push(tuple<double, double, double>(x, y, angle));
-                break;
-            case ']':
-				double pop_x, pop_y, pop_angle;
-				tie(pop_x, pop_y, pop_angle) = saved_position.top();
-				x = pop_x;
-				y = pop_y;
-				angle = pop_angle;
-				saved_position.pop();
-                break;
-            default: break;
-        }
-    }
-    return out_buffer;
-}
+private:
+	DerivationHistory &history;
+	Uint32 wake_event;
+	mutex lock;
+	condition_variable wake;
+	Request pending;
+	uint64_t pending_id = 0;
+	bool has_pending = false;
+	bool stopping = false;
+	atomic<uint64_t> latest{0};
+	atomic<Result *> slot{nullptr};
+	// the level being generated progressively, only ever accessed through atomic_load and atomic_store
+	shared_ptr<GeneratedLevel> growing_level;
+	// under lock: whether the worker waits for a buffer and of what size (levels without a single
+	// vertex still get one), the buffer serve put there, and the buffers of dropped levels
+	bool staging = false;
+	uint64_t staging_bytes = 0;
+	GpuBuffer staged;
+	vector<GpuBuffer> reclaimed;
+	thread worker;
+
+	GpuBuffer allocate(uint64_t bytes, uint64_t id)
+	{
+		// a buffer from the pool through serve, or none once request id is cancelled
+		unique_lock<mutex> guard(lock);
+		staging = true;
+		staging_bytes = bytes;
+		wake_up();
+		wake.wait(guard, [&] { return staged.name || latest.load() != id || stopping; });
+		GpuBuffer buffer = staged;
+		staged = GpuBuffer();
+		staging = false;
+		staging_bytes = 0;
+		return buffer;
+	}
+
+	shared_ptr<GeneratedLevel> make_level(uint64_t id)
+	{
+		// a level that gives its buffer back when the last reference to it is gone, unless it went
+		// to the cache
+		return shared_ptr<GeneratedLevel>(new GeneratedLevel, [this](GeneratedLevel *level) {
+			if (level->lines.vertex_buffer.name) {
+				lock_guard<mutex> guard(lock);
+				reclaimed.push_back(level->lines.vertex_buffer);
+			}
+			delete level;
+		});
+	}
+
+	void wake_up()
+	{
+		SDL_Event event = {};
+		event.type = wake_event;
+		SDL_PushEvent(&event);
+	}
+
+	void run(const Request &request, uint64_t id)
+	{
+		auto cancelled = [&] { return latest.load() != id; };
+		const CompiledLsystem &system = *request.system;
+		unique_ptr<Result> result(new Result);
+		result->id = id;
+		// systems whose subtrees don't all expand the same way are drawn flat
+		result->instanced = request.instancing && can_instance(system);
+		size_t num_iterations = request.num_iterations;
+		size_t admitted = result->instanced ? admissible_instanced_iterations(system, num_iterations, request.budget)
+			: admissible_iterations(system, num_iterations, request.budget);
+		if (admitted != num_iterations) {
+			cerr << "iteration " << num_iterations << " needs "
+				<< (result->instanced ? plan_instancing(system, num_iterations).footprint : predict_generation_footprint(system, num_iterations)) / (1 << 20)
+				<< " MB, over the " << request.budget / (1 << 20) << " MB budget, clamping to " << admitted << endl;
+		}
+		result->num_iterations = admitted;
+		// instanced geometry has no bounding boxes to align levels by
+		result->lowest = request.level_of_detail && !result->instanced ? admitted - min<size_t>(admitted, LOD_LEVELS) : admitted;
+		// the current level first since it is the one on screen, the lower ones after it
+		for (size_t level = admitted + 1; level-- > result->lowest;) {
+			GeometryKey key = geometry_key(system, level, request.forward_distance, request.strips, result->instanced);
+			if (find_if(request.cached.begin(), request.cached.end(), [&](const GeometryKey &cached) { return !(cached < key) && !(key < cached); }) != request.cached.end())
+				continue;
+			if (cancelled())
+				return;
+			shared_ptr<GeneratedLevel> generated = make_level(id);
+			generated->id = id;
+			function<void()> grown;
+			if (level == admitted) {
+				grown = [&] {
+					atomic_store(&growing_level, generated);
+					wake_up();
+				};
+			}
+			if (!generate_level(history, request.fractal, system, level, request.forward_distance, request.strips, result->instanced, request.budget, cancelled,
+				[&](uint64_t bytes) { return allocate(bytes, id); }, *generated, grown))
+				return;
+			result->levels.push_back(generated);
+		}
+		reverse(result->levels.begin(), result->levels.end());
+		// the level stops growing before the result is out, or the gl thread could take the result
+		// and then pick the finished level up again as a growing one
+		atomic_store(&growing_level, shared_ptr<GeneratedLevel>());
+		// a result nobody took yet is stale by now
+		delete slot.exchange(result.release());
+		wake_up();
+	}
+
+	void loop()
+	{
+		unique_lock<mutex> guard(lock);
+		for (;;) {
+			wake.wait(guard, [&] { return has_pending || stopping; });
+			if (stopping)
+				return;
+			Request request = move(pending);
+			uint64_t id = pending_id;
+			has_pending = false;
+			guard.unlock();
+			run(request, id);
+			// for the jobs run gave up on
+			atomic_store(&growing_level, shared_ptr<GeneratedLevel>());
+			guard.lock();
+		}
+	}
+
+public:
+	GenerationWorker(DerivationHistory &history, Uint32 wake_event)
+		: history(history), wake_event(wake_event), worker([this] { loop(); }) {}
+
+	~GenerationWorker() { stop(); }
+
+	void stop()
+	{
+		// cancel the job in flight and wait for the thread to finish
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+			latest++;
+		}
+		wake.notify_one();
+		if (worker.joinable())
+			worker.join();
+		delete slot.exchange(nullptr);
+	}
+
+	uint64_t request(Request request)
+	{
+		// replaces whatever is waiting and cancels the job in flight, returns the id of the result
+		lock_guard<mutex> guard(lock);
+		pending = move(request);
+		pending_id = ++latest;
+		has_pending = true;
+		wake.notify_one();
+		return pending_id;
+	}
+
+	unique_ptr<Result> take()
+	{
+		// the finished result if there is one, never blocks
+		return unique_ptr<Result>(slot.exchange(nullptr));
+	}
+
+	void serve(BufferPool &pool)
+	{
+		// on the gl thread: acquires the buffer the worker is waiting for, and returns the buffers
+		// of dropped levels to the pool
+		lock_guard<mutex> guard(lock);
+		for (GpuBuffer &buffer : reclaimed)
+			pool.release(buffer);
+		reclaimed.clear();
+		if (staging && !staged.name) {
+			staged = pool.acquire(staging_bytes);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			wake.notify_one();
+		}
+	}
+
+	shared_ptr<GeneratedLevel> growing()
+	{
+		// the level being generated progressively if there is one, see GeneratedLevel::done
+		return atomic_load(&growing_level);
+	}
+};
 
 void populate_orthographic_projection_matrix(float screen_width, float screen_height, float transform[16])
 {
@@ -274,6 +4214,8 @@ int main(int argc, char* argv[])
 	// load global shader
 	unsigned int program_id = load_shaders("main.vert", "main.frag");
 	glUseProgram(program_id);
+	// the instance transform read by vertices that aren't instanced: no rotation and no offset
+	glVertexAttrib4f(1, 0, 0, 0, 0);
 
 	vector<Lsystem> fractals = {
 		{ // hexperiment
@@ -345,64 +4287,166 @@ int main(int argc, char* argv[])
 			M_PI / 2,
 			true
 		},
+		{ // stochastic bush, a different plant for every seed
+			{"+", "-", "[", "]"},
+			"F",
+			{},
+			25.7*M_PI/180,
+			true,
+			{},
+			"",
+			{{"F", {{0.33, "F[+F]F[-F]F"}, {0.33, "F[+F]F"}, {0.34, "F[-F]F"}}}},
+			1
+		},
+		{ // parametric tree, branches shrink until they stop splitting
+			{},
+			"A(4)",
+			{},
+			30*M_PI/180,
+			true,
+			{},
+			"",
+			{},
+			0,
+			{
+				"A(s) : s >= 0.5 -> F(s)[+(25)A(s*0.75)][-(35)A(s*0.65)]F(s*0.3)A(s*0.6)",
+				"F(l) -> F(l*1.05)"
+			}
+		},
+		{ // hogeweg plant, signals travelling along the branches
+			{"[", "]", "F"},
+			"F1F1F1",
+			{{"+", "-"}, {"-", "+"}},
+			22.5*M_PI/180,
+			false,
+			{
+				{"0", '0', "0", "0"},
+				{"0", '0', "1", "1[+F1F1]"},
+				{"0", '1', "0", "1"},
+				{"0", '1', "1", "1"},
+				{"1", '0', "0", "0"},
+				{"1", '0', "1", "1F1"},
+				{"1", '1', "0", "1"},
+				{"1", '1', "1", "0"},
+			},
+			"+-F"
+		},
 	};
 
-	string lsystem_instruction = "";
-	vector<float> lsystem_lines;
+	vector<CompiledLsystem> compiled_fractals;
+	for (const Lsystem &fractal : fractals)
+		compiled_fractals.push_back(compile_lsystem(fractal));
+
+	// current level first, then the lower levels kept around for level of detail
+	vector<LodLevel> lod_levels;
 
 	// runtime parameters
 	size_t num_iterations = 2;
 	double forward_distance = 20;
 	double offset_angle = M_PI;
 	size_t fractal_index = 0;
+	bool line_strips = true;
+	bool level_of_detail = false;
+	bool instancing = false;
+	uint64_t memory_budget = (uint64_t)MEMORY_BUDGET_MB << 20;
+	DerivationHistory history(memory_budget);
+	BufferPool buffer_pool((uint64_t)GEOMETRY_CACHE_GPU_MB << 20);
+	GeometryCache geometry_cache(buffer_pool);
+	// the history belongs to the worker from here on, it posts generation_done when a result is in
+	Uint32 generation_done = SDL_RegisterEvents(1);
+	GenerationWorker generation(history, generation_done);
+	uint64_t generation_id = 0;
+	GrowingGeometry growing;
 
+	// dirty flags, nothing is drawn while neither is set: should_draw for the camera and the window,
+	// should_generate for the geometry
 	bool is_done = false;
 	bool should_draw = true;
 	bool should_generate = true;
+	// frame pacing, see FRAME_CAP
+	Uint32 frame_time = FRAME_CAP > 0 ? 1000 / FRAME_CAP : 0;
+	Uint32 last_frame = SDL_GetTicks() - frame_time;
 
 	int screen_offset_x = 0;
 	int screen_offset_y = 0;
 	float zoom = 1.0;
 
-	unsigned int vbo, vao;
-
 	float transform[16] = {0.0};
 	populate_orthographic_projection_matrix((float)WIDTH, (float)HEIGHT, transform);
 
 	while (!is_done) {
 		if (should_generate) {
-			// regenerate the instruction string and cachend lines buffer
-			Lsystem cur = fractals[fractal_index];
-			lsystem_instruction = generate_lsystem(cur, num_iterations);
-			lsystem_lines = generate_lines(lsystem_instruction, cur.angle, forward_distance);
-			// cout << lsystem_lines.size() << endl;
-
-			glGenVertexArrays(1, &vao);
-			glGenBuffers(1, &vbo);
-			glBindVertexArray(vao);
-
-			glBindBuffer(GL_ARRAY_BUFFER, vbo);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(float)*lsystem_lines.size(), &lsystem_lines[0], GL_STATIC_DRAW);
-
-			glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
-			glEnableVertexAttribArray(0);
-
-			glBindBuffer(GL_ARRAY_BUFFER, 0); 
-			glBindVertexArray(0); 
-
+			// regenerate the instruction string and cachend lines buffer on the worker, what is on
+			// screen stays there until it is done
+			generation_id = generation.request({&compiled_fractals[fractal_index], fractal_index, num_iterations, forward_distance,
+				line_strips, instancing, level_of_detail, memory_budget, geometry_cache.keys()});
 			should_generate = false;
 		}
-		// if (should_draw) {
+		generation.serve(buffer_pool);
+		unique_ptr<GenerationWorker::Result> generated = generation.take();
+		if (generated && generated->id == generation_id) {
+			const CompiledLsystem &cur = compiled_fractals[fractal_index];
+			num_iterations = generated->num_iterations;
+			// the inserts may evict what lod_levels points to, so it is dropped first and built
+			// again from lookups, which never evict; the current level is looked up last so it is
+			// the most recently used
+			lod_levels.clear();
+			for (const shared_ptr<GeneratedLevel> &level : generated->levels) {
+				if (!growing.finish(geometry_cache, level))
+					upload_level(geometry_cache, *level);
+			}
+			growing.release();
+			vector<CachedGeometry *> lower_levels;
+			for (size_t level = num_iterations; level-- > generated->lowest;) {
+				CachedGeometry *lower = geometry_cache.find(geometry_key(cur, level, forward_distance, line_strips, false));
+				if (!lower)
+					break;
+				lower_levels.push_back(lower);
+			}
+			CachedGeometry *geometry = geometry_cache.find(geometry_key(cur, num_iterations, forward_distance, line_strips, generated->instanced));
+			if (geometry) {
+				lod_levels.push_back({geometry, {1, 0, 0, 1}, {0, 0}, 1});
+				for (CachedGeometry *lower : lower_levels)
+					lod_levels.push_back(align_level(lower, *geometry, has_branches(cur)));
+				should_draw = true;
+			} else {
+				// evicted since the request was made, nothing is drawn until it is back
+				should_generate = true;
+			}
+		}
+		// the part of the current level that is ready while it is being generated
+		if (growing.update(generation.growing(), generation_id))
+			should_draw = true;
+		bool is_growing = growing.active(generation_id);
+		// nothing to draw until the first geometry is in
+		if (should_draw && (!lod_levels.empty() || is_growing) && SDL_GetTicks() - last_frame >= frame_time) {
+			last_frame = SDL_GetTicks();
 			glUniformMatrix4fv(glGetUniformLocation(program_id, "transform"), 1, GL_FALSE, transform);
-			glUniform2f(glGetUniformLocation(program_id, "offset"), (float)screen_offset_x, (float)screen_offset_y); 
 			glUniform1f(glGetUniformLocation(program_id, "angle"), offset_angle); 
 			glUniform1f(glGetUniformLocation(program_id, "zoom"), zoom); 
-			glUniform1i(glGetUniformLocation(program_id, "numVertices"), lsystem_lines.size()); 
+
+			// level of detail, the similarity goes in front of the basis and into the offset
+			LodLevel lod = is_growing ? LodLevel{&growing.lines(), {1, 0, 0, 1}, {0, 0}, 1} : lod_levels[choose_lod_level(lod_levels, forward_distance, zoom)];
+			const CachedGeometry *geometry = lod.geometry;
+			float lod_offset_x = screen_offset_x, lod_offset_y = screen_offset_y;
+			lod.offset(offset_angle, lod_offset_x, lod_offset_y);
+			glUniform2f(glGetUniformLocation(program_id, "offset"), lod_offset_x, lod_offset_y); 
+			float basis[8];
+			for (int k = 0; k < 4; k++) {
+				basis[2 * k] = lod.similarity[0] * geometry->format.basis[2 * k] + lod.similarity[2] * geometry->format.basis[2 * k + 1];
+				basis[2 * k + 1] = lod.similarity[1] * geometry->format.basis[2 * k] + lod.similarity[3] * geometry->format.basis[2 * k + 1];
+			}
+			glUniformMatrix4x2fv(glGetUniformLocation(program_id, "basis"), 1, GL_FALSE, basis);
+			glUniform1i(glGetUniformLocation(program_id, "numVertices"), geometry->drawn_vertices); 
 
 			// re-draw the fractal
 			glClear(GL_COLOR_BUFFER_BIT);
-			glBindVertexArray(vao);
-			glDrawArrays(GL_LINES, 0, lsystem_lines.size());
+			if (is_growing)
+				draw_prefix(*geometry, growing.size());
+			else if (geometry->instanced())
+				draw_instances(*geometry);
+			else
+				draw_lines(*geometry, ScreenTransform(screen_offset_x, screen_offset_y, offset_angle, zoom).transformed(lod.similarity, lod.translation));
 			// int len = 6;
 			// for (int i = -len/2; i < len/2; i++) {
 			// 	for (int ii = -len/2; ii < len/2; ii++) {
@@ -411,16 +4455,24 @@ int main(int argc, char* argv[])
 			// 			(float)screen_offset_y + ii / zoom * (HEIGHT / len * 2) + HEIGHT / len / zoom
 			// 		);
 			// 		glUniform1f(glGetUniformLocation(program_id, "angle"), offset_angle + i * (2 * M_PI / len) + ii * (2 * M_PI / len)); 
-			// 		glDrawArrays(GL_LINES, 0, lsystem_lines.size());
+			// 		draw_lines(*geometry, ScreenTransform(screen_offset_x, screen_offset_y, offset_angle, zoom));
 			// 	}
 			// }
 
-			glBindVertexArray(0);
 			SDL_GL_SwapWindow(window);
 			should_draw = false;
-		// }
+		}
+		// sleep until there is input, or until the frame cap lets a pending redraw through; every
+		// event that has piled up is handled before the next frame
 		SDL_Event event;
-		while (SDL_PollEvent(&event)) {
+		bool has_event;
+		if (should_generate)
+			has_event = SDL_PollEvent(&event);
+		else if (should_draw && (!lod_levels.empty() || is_growing))
+			has_event = SDL_WaitEventTimeout(&event, frame_time - min(frame_time, SDL_GetTicks() - last_frame));
+		else
+			has_event = SDL_WaitEvent(&event);
+		for (; has_event; has_event = SDL_PollEvent(&event)) {
 			switch (event.type) {
 				case SDL_KEYDOWN:
 					SDL_PumpEvents();
@@ -444,6 +4496,12 @@ int main(int argc, char* argv[])
 						// cycle through fractals
 						case SDLK_f: fractal_index = (fractal_index + 1) % fractals.size(); should_generate = true; should_draw = true; break;
 						case SDLK_v: fractal_index = (fractal_index - 1) % fractals.size(); should_generate = true; should_draw = true; break;
+						// switch between line strips and separate lines
+						case SDLK_l: line_strips = !line_strips; should_generate = true; should_draw = true; break;
+						// draw lower iteration levels while the detail of the higher ones is too small to see
+						case SDLK_o: level_of_detail = !level_of_detail; should_generate = true; should_draw = true; break;
+						// draw repeated subtrees as instances of a single copy of their lines
+						case SDLK_i: instancing = !instancing; should_generate = true; should_draw = true; break;
 						// set number of iterations
 						case SDLK_1: num_iterations = 1; should_generate = true; should_draw = true; break;
 						case SDLK_2: num_iterations = 2; should_generate = true; should_draw = true; break;
@@ -454,11 +4512,23 @@ int main(int argc, char* argv[])
 						case SDLK_7: num_iterations = 7; should_generate = true; should_draw = true; break;
 						case SDLK_8: num_iterations = 8; should_generate = true; should_draw = true; break;
 						case SDLK_9: num_iterations = 9; should_generate = true; should_draw = true; break;
-						case SDLK_MINUS: num_iterations -= 1; should_generate = true; should_draw = true; break;
+						case SDLK_MINUS: if (num_iterations > 0) num_iterations -= 1; should_generate = true; should_draw = true; break;
 						case SDLK_EQUALS: num_iterations += 1; should_generate = true; should_draw = true; break;
 						default: break;
 					}
 					break;
+				case SDL_WINDOWEVENT:
+					if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+						// the projection stays at WIDTH x HEIGHT so culling keeps its screen, the
+						// picture is stretched onto the new size
+						int drawable_width, drawable_height;
+						SDL_GL_GetDrawableSize(window, &drawable_width, &drawable_height);
+						glViewport(0, 0, drawable_width, drawable_height);
+						should_draw = true;
+					} else if (event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+						should_draw = true;
+					}
+					break;
 				case SDL_QUIT: is_done = true; break;
 				default: break;
 			}
@@ -466,6 +4536,13 @@ int main(int argc, char* argv[])
 	}
 
 	// cleanup
+	generation.stop();
+	growing.release();
+	generation.serve(buffer_pool);
+	cout << "geometry cache: " << geometry_cache.hits << " hits, " << geometry_cache.misses << " misses" << endl;
+	cout << "buffer pool: " << buffer_pool.allocated << " allocated, " << buffer_pool.reused << " reused" << endl;
+	geometry_cache.clear();
+	buffer_pool.clear();
 	glDeleteProgram(program_id);
 	if (renderer) {
 		SDL_DestroyRenderer(renderer);
@@ -1,12 +1,18 @@
-#version 150 core
+#version 330 core
 
 uniform float zoom;
 uniform float angle;
 uniform vec2 offset;
 uniform mat4 transform;
 uniform int numVertices;
+// vertex components to the plane, identity for float vertices and the lattice basis for
+// integer ones
+uniform mat4x2 basis;
 
-in vec4 position;
+layout(location = 0) in vec4 position;
+// instanced geometry: plane offset, heading angle and the vertices drawn before the instance less
+// the first vertex of its subtree; all zero for geometry that isn't instanced
+layout(location = 1) in vec4 instance;
 out vec4 pos;
 out float intensity;
 
@@ -52,10 +58,16 @@ void main() {
 	// 	 rotZ(angle* 0.5) * \
 	// 	 position;
 
+	// place the vertex in the plane, turning a heading rotates it clockwise
+	vec2 plane = basis * position;
+	float c = cos(instance.z);
+	float s = sin(instance.z);
+	plane = vec2(c * plane.x + s * plane.y, -s * plane.x + c * plane.y) + instance.xy;
+
 	pos = rotX(angle* 0.3) * \
 		 rotY(angle * 0.0) * \
 		 rotZ(angle* 0.3) * \
-		 position;
+		 vec4(plane, 0.0, 1.0);
 
 
 	// x-y offset
@@ -64,6 +76,6 @@ void main() {
 	// zoom
 	pos.w /= zoom;
 
-	intensity = gl_VertexID;
+	intensity = instance.w + gl_VertexID;
 	gl_Position = pos * transform;
 }